@@ -205,7 +205,7 @@ struct Argument<std::vector<T>> : public ArgumentBase {
 
 private:
     std::vector<ValueWrapper> wrapper;
-    Value val;
+    mutable Value val;
 };
 
 struct ArgumentsBase {
@@ -36,23 +36,22 @@ void bbbb_nonresonant::CreateDatacards(const std::string& output_path)
     for(double x : desc.grid_x)
         desc.signal_points.push_back(analysis::ToString(x));
 
-    for(const auto& channel : desc.channels) {
+    BuildHarvester(harvester, [&](ch::CombineHarvester& cb, const std::string& channel) {
         const auto& ch_categories = GetChannelCategories(channel);
-        harvester.AddObservations(wildcard, ana_name, eras, {channel}, ch_categories);
-        harvester.AddProcesses(desc.signal_points, ana_name, eras, {channel}, signal_processes, ch_categories, true);
-        harvester.AddProcesses(wildcard, ana_name, eras, {channel}, bkg_processes, ch_categories, false);
-    }
-
-    AddSystematics(harvester);
-    ExtractShapes(harvester);
-
-    if(desc.limit_type == LimitType::SM) {
-        harvester.cp().process(signal_processes).ForEachProc([](ch::Process *p) {
-            p->set_rate(p->rate() * sf);
-        });
-    }
-
-    FixNegativeBins(harvester);
+        cb.AddObservations(wildcard, ana_name, eras, {channel}, ch_categories);
+        cb.AddProcesses(desc.signal_points, ana_name, eras, {channel}, signal_processes, ch_categories, true);
+        cb.AddProcesses(wildcard, ana_name, eras, {channel}, bkg_processes, ch_categories, false);
+
+        AddSystematics(cb);
+        ExtractShapes(cb);
+
+        ShapePostProcessing post_processing;
+        if(desc.limit_type == LimitType::SM) {
+            post_processing.scaled_processes = signal_processes;
+            post_processing.rate_scale_factor = sf;
+        }
+        PostProcessShapes(cb, post_processing);
+    });
     ch::SetStandardBinNames(harvester);
 
     std::string output_pattern = "/$TAG/$MASS/$BIN.txt";
@@ -70,13 +69,14 @@ void bbbb_nonresonant::AddSystematics(ch::CombineHarvester& cb)
 {
     static constexpr size_t n_bins = 202;
     using CU = CommonUncertainties;
+    UncertaintyBatch batch;
 
-    CU::lumi().ApplyGlobal(cb, signal_processes);
-    CU::scale_j().DistrType(UncDistributionType::shape).UseEra(false).Apply(cb, signal_processes);
-    CU::res_j().UseEra(false).Apply(cb, signal_processes);
+    CU::lumi().ApplyGlobal(batch, signal_processes);
+    CU::scale_j().DistrType(UncDistributionType::shape).UseEra(false).Apply(batch, signal_processes);
+    CU::res_j().UseEra(false).Apply(batch, signal_processes);
 
     const Uncertainty bkg_hem_mix_norm("bkg_hem_mix_norm", CorrelationRange::Analysis, UncDistributionType::lnU);
-    bkg_hem_mix_norm.Apply(cb, 51.0, bkg_processes);
+    bkg_hem_mix_norm.Apply(batch, 51.0, bkg_processes);
 
     const Uncertainty eff_b_jes("eff_b_jes", CorrelationRange::Experiment, UncDistributionType::shape);
     const Uncertainty eff_b_lf("eff_b_lf", CorrelationRange::Experiment, UncDistributionType::shape);
@@ -88,25 +88,28 @@ void bbbb_nonresonant::AddSystematics(ch::CombineHarvester& cb)
     const Uncertainty eff_b_cferr1("eff_b_cferr1", CorrelationRange::Experiment, UncDistributionType::shape);
     const Uncertainty eff_b_cferr2("eff_b_cferr2", CorrelationRange::Experiment, UncDistributionType::shape);
 
-    eff_b_jes.UseEra(false).Apply(cb, signal_processes);
-    eff_b_lf.UseEra(false).Apply(cb, signal_processes);
-    eff_b_hf.UseEra(false).Apply(cb, signal_processes);
-    eff_b_lfstats1.UseEra(false).Apply(cb, signal_processes);
-    eff_b_lfstats2.UseEra(false).Apply(cb, signal_processes);
-    eff_b_hfstats1.UseEra(false).Apply(cb, signal_processes);
-    eff_b_hfstats2.UseEra(false).Apply(cb, signal_processes);
-    eff_b_cferr1.UseEra(false).Apply(cb, signal_processes);
-    eff_b_cferr2.UseEra(false).Apply(cb, signal_processes);
+    eff_b_jes.UseEra(false).Apply(batch, signal_processes);
+    eff_b_lf.UseEra(false).Apply(batch, signal_processes);
+    eff_b_hf.UseEra(false).Apply(batch, signal_processes);
+    eff_b_lfstats1.UseEra(false).Apply(batch, signal_processes);
+    eff_b_lfstats2.UseEra(false).Apply(batch, signal_processes);
+    eff_b_hfstats1.UseEra(false).Apply(batch, signal_processes);
+    eff_b_hfstats2.UseEra(false).Apply(batch, signal_processes);
+    eff_b_cferr1.UseEra(false).Apply(batch, signal_processes);
+    eff_b_cferr2.UseEra(false).Apply(batch, signal_processes);
 
     for(size_t bin_id = 1; bin_id < n_bins; ++bin_id) {
         const Uncertainty bin_unc("", CorrelationRange::Analysis, UncDistributionType::shape);
-        bin_unc.UseEra(false).ApplyBinByBin(cb, bkg_processes.at(0), bin_id);
+        bin_unc.UseEra(false).ApplyBinByBin(batch, bkg_processes.at(0), bin_id);
+    }
+
+    if(desc.limit_type == LimitType::SM) {
+        CU::QCDscale_ggHH().ApplyGlobal(batch, signal_processes);
+        CU::pdf_ggHH().ApplyGlobal(batch, signal_processes);
+        CU::BR_SM_H_bb().Apply(batch, 2 * CU::BR_SM_H_bb().up_value, signal_processes);
     }
 
-    if(desc.limit_type != LimitType::SM) return;
-    CU::QCDscale_ggHH().ApplyGlobal(cb, signal_processes);
-    CU::pdf_ggHH().ApplyGlobal(cb, signal_processes);
-    CU::BR_SM_H_bb().Apply(cb, 2 * CU::BR_SM_H_bb().up_value, signal_processes);
+    batch.Apply(cb);
 }
 
 } // namespace Run2_2016
@@ -49,101 +49,117 @@ void ttbb_base::AddSystematics(ch::CombineHarvester& cb)
 {
     using ch::syst::SystMap;
     using CU = CommonUncertainties;
+    UncertaintyBatch batch;
     static constexpr double unc_thr = 0.005;
 
-    CU::lumi().ApplyGlobal(cb, signal_processes, bkg_pure_MC, bkg_TT);
-    CU::QCDscale_W().ApplyGlobal(cb, bkg_W);
-    CU::QCDscale_WW().ApplyGlobal(cb, bkg_WW);
-    CU::QCDscale_WZ().ApplyGlobal(cb, bkg_WZ);
-    CU::QCDscale_ZZ().ApplyGlobal(cb, bkg_ZZ);
-    CU::QCDscale_EWK().ApplyGlobal(cb, bkg_EWK);
-    CU::QCDscale_ttbar().ApplyGlobal(cb, bkg_TT);
-    CU::QCDscale_tW().ApplyGlobal(cb, bkg_tW);
-    CU::QCDscale_ZH().ApplyGlobal(cb, bkg_ZH);
+    CU::lumi().ApplyGlobal(batch, signal_processes, bkg_pure_MC, bkg_TT);
+    CU::QCDscale_W().ApplyGlobal(batch, bkg_W);
+    CU::QCDscale_WW().ApplyGlobal(batch, bkg_WW);
+    CU::QCDscale_WZ().ApplyGlobal(batch, bkg_WZ);
+    CU::QCDscale_ZZ().ApplyGlobal(batch, bkg_ZZ);
+    CU::QCDscale_EWK().ApplyGlobal(batch, bkg_EWK);
+    CU::QCDscale_ttbar().ApplyGlobal(batch, bkg_TT);
+    CU::QCDscale_tW().ApplyGlobal(batch, bkg_tW);
+    CU::QCDscale_ZH().ApplyGlobal(batch, bkg_ZH);
 
-    CU::scale_j().Apply(cb, all_mc_processes);
-//    CU::scale_b().ApplyGlobal(cb, signal_processes, bkg_pure_MC, bkg_TT);
+    CU::scale_j().Apply(batch, all_mc_processes);
+//    CU::scale_b().ApplyGlobal(batch, signal_processes, bkg_pure_MC, bkg_TT);
 
     static constexpr double eff_b_unc = 0.02;
-    CU::eff_b().Apply(cb, eff_b_unc, bkg_DY_1b, bkg_VV, bkg_EWK, bkg_ZH, bkg_tW);
-    CU::eff_b().Apply(cb, eff_b_unc * std::sqrt(2.), signal_processes, bkg_DY_2b, bkg_TT);
+    CU::eff_b().Apply(batch, eff_b_unc, bkg_DY_1b, bkg_VV, bkg_EWK, bkg_ZH, bkg_tW);
+    CU::eff_b().Apply(batch, eff_b_unc * std::sqrt(2.), signal_processes, bkg_DY_2b, bkg_TT);
 
-    CU::eff_e().Channel("eTau").Apply(cb, CU::eff_e().up_value, all_mc_processes);
-    CU::eff_m().Channel("muTau").Apply(cb, CU::eff_m().up_value, all_mc_processes);
-    CU::eff_t().Channels({"eTau", "muTau"}).Apply(cb, CU::eff_t().up_value, all_mc_processes);
-    CU::eff_t().Channel("tauTau").Apply(cb, CU::eff_t().up_value * std::sqrt(2.), all_mc_processes);
-    CU::scale_t().Apply(cb, all_mc_processes);
+    CU::eff_e().Channel("eTau").Apply(batch, CU::eff_e().up_value, all_mc_processes);
+    CU::eff_m().Channel("muTau").Apply(batch, CU::eff_m().up_value, all_mc_processes);
+    CU::eff_t().Channels({"eTau", "muTau"}).Apply(batch, CU::eff_t().up_value, all_mc_processes);
+    CU::eff_t().Channel("tauTau").Apply(batch, CU::eff_t().up_value * std::sqrt(2.), all_mc_processes);
+    CU::scale_t().Apply(batch, all_mc_processes);
 
-    CU::topPt().Apply(cb, bkg_TT);
+    CU::topPt().Apply(batch, bkg_TT);
 
+    // The DY and QCD normalization constants are the same for all channel harvesters, so they are computed and
+    // printed only once.
     static const size_t DYUncDim = 4;
-    TMatrixD dy_unc_cov(DYUncDim, DYUncDim);
-    dy_unc_cov[0][0] = 2.727e-06;
-    dy_unc_cov[1][1] = 0.0002202;
-    dy_unc_cov[2][2] = 0.0007727;
-    dy_unc_cov[3][3] = 0.0004435;
-    dy_unc_cov[0][1] = dy_unc_cov[1][0] = -6.962e-06;
-    dy_unc_cov[0][2] = dy_unc_cov[2][0] = 6.771e-06;
-    dy_unc_cov[0][3] = dy_unc_cov[3][0] = -8.506e-06;
-    dy_unc_cov[1][2] = dy_unc_cov[2][1] = -0.0001962;
-    dy_unc_cov[1][3] = dy_unc_cov[3][1] = -3.962e-05;
-    dy_unc_cov[2][3] = dy_unc_cov[3][2] = -0.0001762;
-
-    TVectorD dy_sf(DYUncDim);
-    dy_sf[0] = 1.05357;
-    dy_sf[1] = 1.09229;
-    dy_sf[2] = 1.06439;
-    dy_sf[3] = 0.933618;
-
-    auto dy_w_inv = stat_tools::ComputeWhiteningMatrix(dy_unc_cov).Invert();
-    std::cout << "ttbb: inverse whitening matrix for DY sf covariance matrix" << std::endl;
-    dy_w_inv.Print();
+    static const std::vector<double> dy_sf = { 1.05357, 1.09229, 1.06439, 0.933618 };
+    static const TMatrixD dy_w_inv = []() {
+        TMatrixD dy_unc_cov(DYUncDim, DYUncDim);
+        dy_unc_cov[0][0] = 2.727e-06;
+        dy_unc_cov[1][1] = 0.0002202;
+        dy_unc_cov[2][2] = 0.0007727;
+        dy_unc_cov[3][3] = 0.0004435;
+        dy_unc_cov[0][1] = dy_unc_cov[1][0] = -6.962e-06;
+        dy_unc_cov[0][2] = dy_unc_cov[2][0] = 6.771e-06;
+        dy_unc_cov[0][3] = dy_unc_cov[3][0] = -8.506e-06;
+        dy_unc_cov[1][2] = dy_unc_cov[2][1] = -0.0001962;
+        dy_unc_cov[1][3] = dy_unc_cov[3][1] = -3.962e-05;
+        dy_unc_cov[2][3] = dy_unc_cov[3][2] = -0.0001762;
+
+        TMatrixD w_inv = stat_tools::ComputeWhiteningMatrix(dy_unc_cov).Invert();
+        std::lock_guard<std::mutex> lock(PrintMutex());
+        std::cout << "ttbb: inverse whitening matrix for DY sf covariance matrix" << std::endl;
+        w_inv.Print();
+        return w_inv;
+    }();
 
     for(size_t n = 0; n < DYUncDim; ++n) {
         std::ostringstream ss_unc_name;
         ss_unc_name << "DY_norm_unc_" << n;
         const Uncertainty DY_norm_unc(ss_unc_name.str(), CorrelationRange::Analysis, UncDistributionType::lnN);
         for(size_t k = 0; k < bkg_DY.size(); ++k) {
-            const double unc_value = dy_w_inv[k][n] / dy_sf[k];
+            const double unc_value = dy_w_inv[k][n] / dy_sf.at(k);
 //            if(std::abs(unc_value) >= unc_thr)
-            DY_norm_unc.Apply(cb, unc_value, bkg_DY.at(k));
+            DY_norm_unc.Apply(batch, unc_value, bkg_DY.at(k));
         }
     }
 
-    static const std::map<std::string, std::tuple<double, double, double, double>> qcd_os_ss_sf = {
-        { "eTau", std::make_tuple(1.24, 0.05, 1.87, 0.13 /*2.663, 0.167*/) },
-        { "muTau", std::make_tuple(1.363, 0.055, 2.108, 0.149 /*4.252, 0.403*/) },
-        { "tauTau", std::make_tuple(1.6, 0.1, 1.521, 0.172 /*2.729, 0.260*/) }
+    struct QCDScaleFactor {
+        double value, rel_stat_unc, rel_ext_unc, unc_up, unc_down;
     };
+    static const std::map<std::string, QCDScaleFactor> qcd_os_ss_sf = []() {
+        const std::map<std::string, std::tuple<double, double, double, double>> measured_sf = {
+            { "eTau", std::make_tuple(1.24, 0.05, 1.87, 0.13 /*2.663, 0.167*/) },
+            { "muTau", std::make_tuple(1.363, 0.055, 2.108, 0.149 /*4.252, 0.403*/) },
+            { "tauTau", std::make_tuple(1.6, 0.1, 1.521, 0.172 /*2.729, 0.260*/) }
+        };
+        std::map<std::string, QCDScaleFactor> sf_map;
+        for(const auto& sf_entry : measured_sf) {
+            QCDScaleFactor& sf = sf_map[sf_entry.first];
+            sf.value = std::get<0>(sf_entry.second);
+            sf.rel_stat_unc = std::get<1>(sf_entry.second) / std::get<0>(sf_entry.second);
+            sf.rel_ext_unc = 0;
+//            if(std::abs(std::get<2>(sf_entry.second) - std::get<0>(sf_entry.second)) >
+//                    std::get<1>(sf_entry.second) + std::get<3>(sf_entry.second))
+//                sf.rel_ext_unc = std::get<2>(sf_entry.second) / std::get<0>(sf_entry.second) - 1;
+            const double cmb_unc = std::sqrt(std::pow(sf.rel_stat_unc, 2) + std::pow(sf.rel_ext_unc, 2));
+            sf.unc_up = sf.rel_ext_unc > 0 ? cmb_unc : sf.rel_stat_unc;
+            sf.unc_down = sf.rel_ext_unc < 0 ? -cmb_unc : -sf.rel_stat_unc;
+        }
+        return sf_map;
+    }();
+
     const Uncertainty qcd_norm("qcd_norm", CorrelationRange::Category, UncDistributionType::lnN);
-    for(const auto& channel : desc.channels) {
+    const Uncertainty qcd_sf_unc("qcd_sf_unc", CorrelationRange::Channel, UncDistributionType::lnN);
+    for(const auto& channel : cb.channel_set()) {
+        const QCDScaleFactor& qcd_sf = qcd_os_ss_sf.at(channel);
         for(const auto& category : desc.categories) {
             const Yield qcd_yield = GetBackgroundYield(bkg_QCD, channel, category);
-            const double ss_qcd_yield = qcd_yield.value / std::get<0>(qcd_os_ss_sf.at(channel));
+            const double ss_qcd_yield = qcd_yield.value / qcd_sf.value;
             const double rel_error = 1 / std::sqrt(ss_qcd_yield);
             if(rel_error >= unc_thr)
-                qcd_norm.Channel(channel).Category(category).Apply(cb, rel_error, bkg_QCD);
+                qcd_norm.Channel(channel).Category(category).Apply(batch, rel_error, bkg_QCD);
         }
-    }
 
-    const Uncertainty qcd_sf_unc("qcd_sf_unc", CorrelationRange::Channel, UncDistributionType::lnN);
-    for(const auto& sf_entry : qcd_os_ss_sf) {
-        const double rel_stat_unc = std::get<1>(sf_entry.second) / std::get<0>(sf_entry.second);
-        double rel_ext_unc = 0;
-//        if(std::abs(std::get<2>(sf_entry.second) - std::get<0>(sf_entry.second)) >
-//                std::get<1>(sf_entry.second) + std::get<3>(sf_entry.second))
-//            rel_ext_unc = std::get<2>(sf_entry.second) / std::get<0>(sf_entry.second) - 1;
-        const double cmb_unc = std::sqrt(std::pow(rel_stat_unc, 2) + std::pow(rel_ext_unc, 2));
-        const double cmb_unc_up = rel_ext_unc > 0 ? cmb_unc : rel_stat_unc;
-        const double cmb_unc_down = rel_ext_unc < 0 ? -cmb_unc : -rel_stat_unc;
-        qcd_sf_unc.Channel(sf_entry.first).Apply(cb, std::make_pair(cmb_unc_up, cmb_unc_down), bkg_QCD);
+        qcd_sf_unc.Channel(channel).Apply(batch, std::make_pair(qcd_sf.unc_up, qcd_sf.unc_down), bkg_QCD);
+        std::lock_guard<std::mutex> lock(PrintMutex());
         const auto prev_precision = std::cout.precision();
-        std::cout << std::setprecision(4) << "ttbb/" << sf_entry.first << ": QCD OS/SS scale factor uncertainties:\n"
-                  << "\tstat unc: +/- " << rel_stat_unc * 100 << "%\n"
-                  << "\textrapolation unc: " << rel_ext_unc * 100 << "%\n"
-                  << "\ttotal unc: +" << cmb_unc_up * 100 << "% / " << cmb_unc_down * 100 << "%."
+        std::cout << std::setprecision(4) << "ttbb/" << channel << ": QCD OS/SS scale factor uncertainties:\n"
+                  << "\tstat unc: +/- " << qcd_sf.rel_stat_unc * 100 << "%\n"
+                  << "\textrapolation unc: " << qcd_sf.rel_ext_unc * 100 << "%\n"
+                  << "\ttotal unc: +" << qcd_sf.unc_up * 100 << "% / " << qcd_sf.unc_down * 100 << "%."
                   << std::setprecision(prev_precision) << std::endl;
     }
+
+    batch.Apply(cb);
 }
 
 } // namespace Run2_2016
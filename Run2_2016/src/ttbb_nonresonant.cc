@@ -27,28 +27,28 @@ void ttbb_nonresonant::CreateDatacards(const std::string& output_path)
     for(double x : desc.grid_x)
         desc.signal_points.push_back(analysis::ToString(x));
 
-    for(const auto& channel : desc.channels) {
+    BuildHarvester(harvester, [&](ch::CombineHarvester& cb, const std::string& channel) {
         const auto& ch_categories = GetChannelCategories(channel);
-        harvester.AddObservations(wildcard, ana_name, eras, {channel}, ch_categories);
-        harvester.AddProcesses(desc.signal_points, ana_name, eras, {channel}, signal_processes, ch_categories, true);
-        harvester.AddProcesses(wildcard, ana_name, eras, {channel}, bkg_all, ch_categories, false);
-    }
+        cb.AddObservations(wildcard, ana_name, eras, {channel}, ch_categories);
+        cb.AddProcesses(desc.signal_points, ana_name, eras, {channel}, signal_processes, ch_categories, true);
+        cb.AddProcesses(wildcard, ana_name, eras, {channel}, bkg_all, ch_categories, false);
 
-    AddSystematics(harvester);
-    ExtractShapes(harvester);
+        AddSystematics(cb);
+        ExtractShapes(cb);
 
-    if(desc.limit_type == LimitType::SM) {
-        harvester.cp().process(signal_processes).ForEachProc([](ch::Process *p) {
-            p->set_rate(p->rate() * sf);
-        });
-    }
-
-    if(desc.model_signal_process.size())
-        RenameProcess(harvester, desc.signal_process, desc.model_signal_process);
-
-    FixNegativeBins(harvester);
-    harvester.cp().backgrounds().MergeBinErrors(bbb_unc_threshold, bin_merge_threashold);
-    harvester.cp().backgrounds().AddBinByBin(bbb_unc_threshold, true, &harvester);
+        ShapePostProcessing post_processing;
+        if(desc.limit_type == LimitType::SM) {
+            post_processing.scaled_processes = signal_processes;
+            post_processing.rate_scale_factor = sf;
+        }
+        if(desc.model_signal_process.size())
+            post_processing.renamed_processes[desc.signal_process] = desc.model_signal_process;
+        post_processing.merge_bin_errors = true;
+        post_processing.bbb_threshold = bbb_unc_threshold;
+        post_processing.merge_threshold = bin_merge_threashold;
+        PostProcessShapes(cb, post_processing);
+        cb.cp().backgrounds().AddBinByBin(bbb_unc_threshold, true, &cb);
+    });
     ch::SetStandardBinNames(harvester);
 
     harvester.SetGroup("QCD_bbb", { ".*_QCD_bin_[0-9]+" });
@@ -59,17 +59,7 @@ void ttbb_nonresonant::CreateDatacards(const std::string& output_path)
     ch::CardWriter writer(output_path + output_pattern, output_path + "/$TAG/hh_ttbb_input.root");
     if(desc.morph)
         writer.SetWildcardMasses({});
-    if(desc.combine_channels)
-        writer.WriteCards("cmb", harvester);
-    if(desc.per_channel_limits) {
-        for(const auto& chn : desc.channels)
-            writer.WriteCards(chn, harvester.cp().channel({chn}));
-    }
-    if(desc.per_category_limits) {
-        for(size_t n = 0; n < desc.categories.size(); ++n) {
-            writer.WriteCards(desc.categories.at(n), harvester.cp().bin_id({int(n)}));
-        }
-    }
+    WriteCards(writer, harvester);
 }
 
 void ttbb_nonresonant::AddSystematics(ch::CombineHarvester& cb)
@@ -78,10 +68,13 @@ void ttbb_nonresonant::AddSystematics(ch::CombineHarvester& cb)
     ttbb_base::AddSystematics(cb);
     if(desc.limit_type != LimitType::SM) return;
 
-    CU::QCDscale_ggHH().ApplyGlobal(cb, signal_processes);
-    CU::pdf_ggHH().ApplyGlobal(cb, signal_processes);
-    CU::BR_SM_H_bb().ApplyGlobal(cb, signal_processes);
-    CU::BR_SM_H_tautau().ApplyGlobal(cb, signal_processes);
+    UncertaintyBatch batch;
+
+    CU::QCDscale_ggHH().ApplyGlobal(batch, signal_processes);
+    CU::pdf_ggHH().ApplyGlobal(batch, signal_processes);
+    CU::BR_SM_H_bb().ApplyGlobal(batch, signal_processes);
+    CU::BR_SM_H_tautau().ApplyGlobal(batch, signal_processes);
+    batch.Apply(cb);
 }
 
 } // namespace Run2_2016
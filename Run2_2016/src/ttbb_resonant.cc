@@ -20,27 +20,29 @@ void ttbb_resonant::CreateDatacards(const std::string& output_path)
 {
     ch::CombineHarvester harvester;
 
-    for(const auto& channel : desc.channels) {
+    BuildHarvester(harvester, [&](ch::CombineHarvester& cb, const std::string& channel) {
         const auto& ch_categories = GetChannelCategories(channel);
-        harvester.AddObservations(wildcard, ana_name, eras, {channel}, ch_categories);
-        harvester.AddProcesses(desc.signal_points, ana_name, eras, {channel}, signal_processes, ch_categories, true);
-        harvester.AddProcesses(wildcard, ana_name, eras, {channel}, bkg_MC, ch_categories, false);
+        cb.AddObservations(wildcard, ana_name, eras, {channel}, ch_categories);
+        cb.AddProcesses(desc.signal_points, ana_name, eras, {channel}, signal_processes, ch_categories, true);
+        cb.AddProcesses(wildcard, ana_name, eras, {channel}, bkg_MC, ch_categories, false);
         for(size_t n = 0; n < desc.categories.size(); ++n) {
             const Yield qcd_yield = GetBackgroundYield(bkg_QCD, channel, desc.categories.at(n));
             if(qcd_yield.value <= 0) continue;
-            harvester.AddProcesses(wildcard, ana_name, eras, {channel}, {bkg_QCD}, {ch_categories.at(n)}, false);
+            cb.AddProcesses(wildcard, ana_name, eras, {channel}, {bkg_QCD}, {ch_categories.at(n)}, false);
         }
-    }
-
-    AddSystematics(harvester);
-    ExtractShapes(harvester);
 
-    if(desc.model_signal_process.size())
-        RenameProcess(harvester, desc.signal_process, desc.model_signal_process);
+        AddSystematics(cb);
+        ExtractShapes(cb);
 
-    FixNegativeBins(harvester);    
-    harvester.cp().backgrounds().MergeBinErrors(bbb_unc_threshold, bin_merge_threashold);
-    harvester.cp().backgrounds().AddBinByBin(bbb_unc_threshold, true, &harvester);
+        ShapePostProcessing post_processing;
+        if(desc.model_signal_process.size())
+            post_processing.renamed_processes[desc.signal_process] = desc.model_signal_process;
+        post_processing.merge_bin_errors = true;
+        post_processing.bbb_threshold = bbb_unc_threshold;
+        post_processing.merge_threshold = bin_merge_threashold;
+        PostProcessShapes(cb, post_processing);
+        cb.cp().backgrounds().AddBinByBin(bbb_unc_threshold, true, &cb);
+    });
     ch::SetStandardBinNames(harvester);
 
     std::shared_ptr<RooWorkspace> workspace;
@@ -59,17 +61,7 @@ void ttbb_resonant::CreateDatacards(const std::string& output_path)
     ch::CardWriter writer(output_path + output_pattern, output_path + "/$TAG/hh_ttbb_input.root");
     if(desc.morph)
         writer.SetWildcardMasses({});
-    if(desc.combine_channels)
-        writer.WriteCards("cmb", harvester);
-    if(desc.per_channel_limits) {
-        for(const auto& chn : desc.channels)
-            writer.WriteCards(chn, harvester.cp().channel({chn}));
-    }
-    if(desc.per_category_limits) {
-        for(size_t n = 0; n < desc.categories.size(); ++n) {
-            writer.WriteCards(desc.categories.at(n), harvester.cp().bin_id({int(n)}));
-        }
-    }
+    WriteCards(writer, harvester);
 }
 
 } // namespace Run2_2016
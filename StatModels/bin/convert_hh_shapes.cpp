@@ -0,0 +1,58 @@
+/*! Tool to convert a shapes file into the uncompressed memory-mapped sidecar used by the stat models.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#include "HHStatAnalysis/Core/interface/program_main.h"
+#include "HHStatAnalysis/Core/interface/exception.h"
+#include "HHStatAnalysis/Core/interface/RootExt.h"
+#include "HHStatAnalysis/StatModels/interface/ShapeIndex.h"
+#include "HHStatAnalysis/StatModels/interface/ShapeSidecar.h"
+
+namespace hh_analysis {
+using namespace analysis;
+
+struct Arguments : run::ArgumentsBase {
+    StrArg shapes{ "shapes", "file with input shapes" };
+    StrArg output{ "output", "output sidecar file (by default it is created next to the shapes file)", "" };
+    Arg<bool> verify{ "verify", "check that the existing sidecar is up to date, including the checksum of the shapes"
+                      " file, instead of creating it", false };
+};
+
+class ConvertHHShapes {
+public:
+    ConvertHHShapes(const Arguments& _args) : args(_args) {}
+
+    void Run()
+    {
+        if(args.verify()) {
+            if(args.output().size())
+                throw exception("Verification is supported only for the sidecar next to the shapes file.");
+            if(!ShapeSidecar::TryOpen(args.shapes(), true))
+                throw exception("Sidecar of '%1%' is missing or outdated.") % args.shapes();
+            std::cout << boost::format("Sidecar of '%1%' is up to date.") % args.shapes() << std::endl;
+            return;
+        }
+        const std::string output = args.output().size() ? args.output() : ShapeSidecar::GetFileName(args.shapes());
+        const ShapeIndex index(root_ext::OpenRootFile(args.shapes()));
+        std::vector<std::pair<std::string, const TH1*>> hists;
+        size_t n_skipped = 0;
+        for(const std::string& name : index.GetNames()) {
+            const TH1* hist = index.Get<TH1>(name);
+            if(hist->GetDimension() == 1 && (dynamic_cast<const TH1F*>(hist) || dynamic_cast<const TH1D*>(hist)))
+                hists.emplace_back(name, hist);
+            else
+                ++n_skipped;
+        }
+        ShapeSidecar::Write(output, args.shapes(), hists);
+        std::cout << boost::format("%1% histograms are written into '%2%'.") % hists.size() % output << std::endl;
+        if(n_skipped)
+            std::cout << boost::format("%1% histograms that are not TH1F or TH1D are not converted and will be read"
+                                       " from the shapes file.") % n_skipped << std::endl;
+    }
+
+private:
+    Arguments args;
+};
+
+} // namespace hh_analysis
+
+PROGRAM_MAIN(hh_analysis::ConvertHHShapes, hh_analysis::Arguments)
@@ -2,18 +2,35 @@
 This file is part of https://github.com/cms-hh/HHStatAnalysis. */
 
 #include <dlfcn.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <boost/filesystem.hpp>
 #include "HHStatAnalysis/Core/interface/program_main.h"
 #include "HHStatAnalysis/Core/interface/exception.h"
 #include "HHStatAnalysis/StatModels/interface/Config.h"
 #include "HHStatAnalysis/StatModels/interface/StatModel.h"
+#include "HHStatAnalysis/StatModels/interface/ThreadPool.h"
+#include "HHStatAnalysis/StatModels/interface/RootThreads.h"
 
 namespace {
 
 struct Arguments {
-    run::Argument<std::string> cfg{"cfg", "configuration file"};
-    run::Argument<std::string> model_desc{"model-desc", "name of the stat model descriptor in the config"};
-    run::Argument<std::string> shapes{"shapes", "file with input shapes"};
-    run::Argument<std::string> output_path{"output", "path where to store created datacards"};
+    run::Argument<std::string> cfg{"cfg", "configuration file", ""};
+    run::Argument<std::string> model_desc{"model-desc", "comma separated names of the stat model descriptors"
+                                                        " in the config", ""};
+    run::Argument<std::string> shapes{"shapes", "file with input shapes", ""};
+    run::Argument<std::string> output_path{"output", "path where to store created datacards. If several descriptors"
+                                                     " are specified, datacards are stored in <output>/<descriptor>",
+                                           ""};
+    run::Argument<size_t> threads{"threads", "number of descriptors to process concurrently", 1};
+    run::Argument<std::string> server{"server", "run as a server that listens for the requests on the given unix"
+                                                " socket (see create_hh_datacards_client.py)", ""};
 };
 
 } // anonymous namespace
@@ -25,32 +42,228 @@ public:
     CreateHHDatacards(const Arguments& _args) : args(_args) {}
 
     void Run()
+    {
+        if(args.server().size()) {
+            Serve(args.server());
+            return;
+        }
+        if(args.cfg().empty() || args.model_desc().empty() || args.shapes().empty() || args.output_path().empty())
+            throw exception("Arguments cfg, model-desc, shapes and output should be specified.");
+        CreateDatacards(args.cfg(), args.model_desc(), args.shapes(), args.output_path());
+    }
+
+private:
+    struct Job {
+        StatModelDescriptor desc;
+        std::string output_path;
+        stat_models::StatModelPtr model;
+    };
+
+    // Indexes of the shape files used by the server requests, which are kept open between the requests.
+    struct ShapesEntry {
+        off_t size;
+        timespec last_write_time;
+        std::shared_ptr<ShapeIndex> index;
+
+        bool IsUpToDate(const struct stat& file_stat) const
+        {
+            return size == file_stat.st_size && last_write_time.tv_sec == file_stat.st_mtim.tv_sec
+                    && last_write_time.tv_nsec == file_stat.st_mtim.tv_nsec;
+        }
+    };
+
+    void CreateDatacards(const std::string& cfg, const std::string& model_desc, const std::string& shapes,
+                         const std::string& output_path)
+    {
+        const auto desc_names = SplitValueList(model_desc, false, ",");
+        if(desc_names.empty())
+            throw exception("No stat model descriptors are specified.");
+        ModelDescriptorCollection descs;
+        ReadConfig(cfg, descs);
+
+        std::vector<Job> jobs;
+        for(const auto& desc_name : desc_names) {
+            if(!descs.count(desc_name))
+                throw exception("Unable to find %1% in %2%.") % desc_name % cfg;
+            Job job;
+            job.desc = descs.at(desc_name);
+            job.output_path = desc_names.size() > 1 ? output_path + "/" + desc_name : output_path;
+            job.model = CreateModel(job.desc, shapes);
+            jobs.push_back(job);
+        }
+
+        // RooFit objects used by the morphing can't be created concurrently, so such models are processed serially.
+        std::vector<const Job*> parallel_jobs, serial_jobs;
+        for(const Job& job : jobs)
+            (job.desc.morph ? serial_jobs : parallel_jobs).push_back(&job);
+        ThreadPool pool(args.threads());
+        if(pool.GetNumberOfThreads() > 1 && parallel_jobs.size() > 1)
+            EnableRootThreadSafety();
+        pool.ParallelFor(parallel_jobs.size(), [&](size_t n) { RunJob(*parallel_jobs.at(n), shapes); });
+        for(const Job* job : serial_jobs)
+            RunJob(*job, shapes);
+    }
+
+    stat_models::StatModelPtr CreateModel(const StatModelDescriptor& model_desc, const std::string& shapes)
     {
         static const std::string creator_fn_name = "create_stat_model";
-        const StatModelDescriptor model_desc = LoadDescriptor(args.cfg(), args.model_desc());
         const auto stat_model_ref = SplitValueList(model_desc.stat_model, true, "/");
         if(stat_model_ref.size() != 2)
             throw exception("Bad stat model name '%1%'") % model_desc.stat_model;
         const std::string library_name = boost::str(boost::format("libHHStatAnalysis%1%.so") % stat_model_ref.at(0));
         const std::string stat_model_name = stat_model_ref.at(1);
-        void* handle = dlopen(library_name.c_str(), RTLD_LAZY);
-        if(!handle)
-            throw exception("Unknown library reference '%1%' in the model descriptor."
-                            " Stat model library '%2%' not found.") % stat_model_ref.at(0) % library_name;
-        auto creator = (stat_models::StatModelCreator) dlsym(handle, creator_fn_name.c_str());
-        if(!creator)
-            throw exception("Unable to load %1% function from %2%.") % creator_fn_name % library_name;
-        auto model = creator(stat_model_name.c_str(), &model_desc, args.shapes().c_str());
+        auto& creator = creators[library_name];
+        if(!creator) {
+            void* handle = dlopen(library_name.c_str(), RTLD_LAZY);
+            if(!handle)
+                throw exception("Unknown library reference '%1%' in the model descriptor."
+                                " Stat model library '%2%' not found.") % stat_model_ref.at(0) % library_name;
+            creator = (stat_models::StatModelCreator) dlsym(handle, creator_fn_name.c_str());
+            if(!creator)
+                throw exception("Unable to load %1% function from %2%.") % creator_fn_name % library_name;
+        }
+        auto model = creator(stat_model_name.c_str(), &model_desc, shapes.c_str());
         if(!model)
             throw exception("Unable to create an object for stat model '%1%'.") % model_desc.stat_model;
-        std::cout << boost::format("Creating datacards for %1% unc model using %2% shapes...")
-                     % model_desc.stat_model % args.shapes() << std::endl;
-        model->CreateDatacards(args.output_path());
-        std::cout << boost::format("Datacards are successfully created into '%1%'.") % args.output_path() << std::endl;
+        return model;
+    }
+
+    void RunJob(const Job& job, const std::string& shapes)
+    {
+        {
+            std::lock_guard<std::mutex> lock(print_mutex);
+            std::cout << boost::format("Creating datacards for %1% unc model using %2% shapes...")
+                         % job.desc.stat_model % shapes << std::endl;
+        }
+        job.model->CreateDatacards(job.output_path);
+        std::lock_guard<std::mutex> lock(print_mutex);
+        std::cout << boost::format("Datacards are successfully created into '%1%'.") % job.output_path << std::endl;
+    }
+
+    // Requests are processed one by one. Each request is a single line with tab separated fields:
+    //   create <cfg> <model-desc> <shapes> <output>
+    //   shutdown
+    // The response is a single line 'OK<tab>message' or 'ERROR<tab>message'.
+    void Serve(const std::string& socket_path)
+    {
+        const int server_fd = CreateServerSocket(socket_path);
+        std::cout << boost::format("Waiting for requests on '%1%'...") % socket_path << std::endl;
+        bool stop = false;
+        while(!stop) {
+            const int client_fd = accept(server_fd, nullptr, nullptr);
+            if(client_fd < 0) {
+                if(errno == EINTR) continue;
+                close(server_fd);
+                throw exception("Unable to accept connection on '%1%': %2%.") % socket_path % std::strerror(errno);
+            }
+            std::string response;
+            try {
+                SetReceiveTimeout(client_fd);
+                const auto request = SplitValueList(ReadLine(client_fd), true, "\t", true);
+                if(request.size() == 1 && request.at(0) == "shutdown") {
+                    stop = true;
+                    response = "OK\tserver is stopped";
+                } else if(request.size() == 5 && request.at(0) == "create") {
+                    PinShapes(request.at(3));
+                    CreateDatacards(request.at(1), request.at(2), request.at(3), request.at(4));
+                    response = "OK\tdatacards are created into '" + request.at(4) + "'";
+                } else {
+                    throw exception("Bad request.");
+                }
+            } catch(std::exception& e) {
+                response = std::string("ERROR\t") + e.what();
+                std::cerr << "ERROR: " << e.what() << std::endl;
+            }
+            std::replace(response.begin(), response.end(), '\n', ' ');
+            response += "\n";
+            if(send(client_fd, response.c_str(), response.size(), MSG_NOSIGNAL) < 0)
+                std::cerr << "ERROR: unable to send the response: " << std::strerror(errno) << std::endl;
+            close(client_fd);
+        }
+        close(server_fd);
+        unlink(socket_path.c_str());
+    }
+
+    static int CreateServerSocket(const std::string& socket_path)
+    {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if(socket_path.size() >= sizeof(address.sun_path))
+            throw exception("Socket path '%1%' is too long.") % socket_path;
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        // Only a socket left by a previous server can be replaced, any other file at this path is kept.
+        struct stat path_stat;
+        if(lstat(socket_path.c_str(), &path_stat) == 0) {
+            if(!S_ISSOCK(path_stat.st_mode))
+                throw exception("'%1%' already exists and is not a socket.") % socket_path;
+            unlink(socket_path.c_str());
+        }
+
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0)
+            throw exception("Unable to create socket: %1%.") % std::strerror(errno);
+        // The server writes datacards with the permissions of its owner, so only the owner can connect to it.
+        const mode_t prev_umask = umask(S_IRWXG | S_IRWXO);
+        const bool listening = bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+                && chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) == 0 && listen(fd, SOMAXCONN) == 0;
+        const std::string error = std::strerror(errno);
+        umask(prev_umask);
+        if(!listening) {
+            close(fd);
+            throw exception("Unable to listen on '%1%': %2%.") % socket_path % error;
+        }
+        return fd;
+    }
+
+    // Requests should arrive right after the connection, so an idle client can't block the server.
+    static void SetReceiveTimeout(int fd)
+    {
+        static const long timeout_seconds = 30;
+        timeval timeout;
+        timeout.tv_sec = timeout_seconds;
+        timeout.tv_usec = 0;
+        if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+            throw exception("Unable to set the receive timeout: %1%.") % std::strerror(errno);
+    }
+
+    static std::string ReadLine(int fd)
+    {
+        static const size_t max_length = 64 * 1024;
+        std::string line;
+        char c;
+        while(line.size() < max_length) {
+            const ssize_t n_read = read(fd, &c, 1);
+            if(n_read < 0 && errno == EINTR) continue;
+            if(n_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                throw exception("Timeout while waiting for the request.");
+            if(n_read <= 0 || c == '\n') return line;
+            line.push_back(c);
+        }
+        throw exception("Request is too long.");
+    }
+
+    // The shapes file is indexed again if its size or modification time (with the nanosecond resolution) has
+    // changed since the previous request.
+    void PinShapes(const std::string& file_name)
+    {
+        struct stat file_stat;
+        if(stat(file_name.c_str(), &file_stat) != 0)
+            throw exception("Unable to access '%1%': %2%.") % file_name % std::strerror(errno);
+        auto iter = pinned_shapes.find(file_name);
+        if(iter != pinned_shapes.end() && iter->second.IsUpToDate(file_stat)) return;
+        if(iter != pinned_shapes.end())
+            pinned_shapes.erase(iter);
+        pinned_shapes[file_name] = ShapesEntry{ file_stat.st_size, file_stat.st_mtim,
+                                                stat_models::StatModel::OpenShapes(file_name) };
     }
 
 private:
     Arguments args;
+    std::map<std::string, stat_models::StatModelCreator> creators;
+    std::map<std::string, ShapesEntry> pinned_shapes;
+    std::mutex print_mutex;
 };
 
 } // namespace hh_analysis
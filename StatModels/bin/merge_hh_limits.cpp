@@ -0,0 +1,239 @@
+/*! Tool to merge hh limits: for each limit file the result with the best expected limit is selected.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#include <set>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <TFile.h>
+#include <TTree.h>
+#include "HHStatAnalysis/Core/interface/program_main.h"
+#include "HHStatAnalysis/Core/interface/exception.h"
+#include "HHStatAnalysis/Core/interface/RootExt.h"
+#include "HHStatAnalysis/StatModels/interface/ThreadPool.h"
+#include "HHStatAnalysis/StatModels/interface/CombineLimits.h"
+
+namespace hh_analysis {
+using namespace analysis;
+using namespace combine_limits;
+
+struct Arguments : run::ArgumentsBase {
+    StrArg merge_output{ "merge-output", "path were to store merged limits" };
+    StrArg merged_tree{ "merged-tree", "ROOT file with the limit tree merged from all selected files"
+                        " (relative to the merge output)", "merged_limits.root" };
+    StrArg summary{ "summary", "ROOT file with the summary tree: one entry per limit file"
+                    " (relative to the merge output)", "limits_summary.root" };
+    StrArg pattern{ "pattern", "regex for the names of the limit files", "higgsCombine\\..*\\.root" };
+    Arg<size_t> threads{ "threads", "number of threads (0 - use all available hardware threads)", 1 };
+    Arg<std::vector<std::string>> output{ "output", "paths were limits are stored" };
+};
+
+// Best result for a single limit file.
+struct MergedLimit {
+    std::string file_name;
+    size_t source_id;
+    double mass;
+    QuantileLimits limits;
+};
+
+class MergeHHLimits {
+public:
+    MergeHHLimits(const Arguments& _args) : args(_args), pool(args.threads()) {}
+
+    void Run()
+    {
+        const auto& sources = args.output();
+        if(sources.empty())
+            throw exception("No input paths are specified.");
+        if(pool.GetNumberOfThreads() > 1)
+            EnableRootThreadSafety();
+
+        const auto limit_files = CollectLimitFiles(sources);
+        if(limit_files.empty())
+            throw exception("No limit files are found.");
+        std::cout << "Merging " << limit_files.size() << " limit files from " << sources.size() << " paths."
+                  << std::endl;
+
+        // Output directories are created before the parallel copy, because several limit files can share the same
+        // directory and create_directories is not safe to call concurrently for the same path.
+        std::set<boost::filesystem::path> output_dirs;
+        for(const auto& file_name : limit_files)
+            output_dirs.insert(boost::filesystem::path(FullName(args.merge_output(), file_name)).parent_path());
+        for(const auto& dir : output_dirs)
+            boost::filesystem::create_directories(dir);
+
+        std::vector<MergedLimit> merged(limit_files.size());
+        pool.ParallelFor(limit_files.size(), [&](size_t n) {
+            merged.at(n) = SelectBestLimit(sources, limit_files.at(n));
+            const std::string& best_file = FullName(sources.at(merged.at(n).source_id), limit_files.at(n));
+            const boost::filesystem::path output_file = FullName(args.merge_output(), limit_files.at(n));
+            boost::filesystem::copy_file(best_file, output_file,
+                                         boost::filesystem::copy_option::overwrite_if_exists);
+        });
+
+        PrintSummary(sources, merged);
+        WriteMergedTree(FullName(args.merge_output(), args.merged_tree()), merged);
+        WriteSummary(FullName(args.merge_output(), args.summary()), sources, merged);
+    }
+
+private:
+    static std::string FullName(const std::string& path, const std::string& file_name)
+    {
+        return (boost::filesystem::path(path) / file_name).string();
+    }
+
+    // Relative names of the limit files found in any of the sources, in the sorted order.
+    std::vector<std::string> CollectLimitFiles(const std::vector<std::string>& sources)
+    {
+        const boost::regex pattern(args.pattern());
+        std::vector<std::vector<std::string>> source_files(sources.size());
+        pool.ParallelFor(sources.size(), [&](size_t source_id) {
+            using namespace boost::filesystem;
+            const path source(sources.at(source_id));
+            const size_t prefix_size = source.string().size();
+            for(recursive_directory_iterator iter(source), end; iter != end; ++iter) {
+                if(!is_regular_file(iter->status())) continue;
+                const path& file_path = iter->path();
+                if(!boost::regex_match(file_path.filename().string(), pattern)) continue;
+                std::string relative_name = file_path.string().substr(prefix_size);
+                while(relative_name.size() && relative_name.front() == '/')
+                    relative_name.erase(0, 1);
+                source_files.at(source_id).push_back(relative_name);
+            }
+        });
+
+        std::set<std::string> all_files;
+        for(const auto& files : source_files)
+            all_files.insert(files.begin(), files.end());
+        return std::vector<std::string>(all_files.begin(), all_files.end());
+    }
+
+    // Source with the lowest median expected limit. If several sources have the same limit, the first one is taken.
+    static MergedLimit SelectBestLimit(const std::vector<std::string>& sources, const std::string& file_name)
+    {
+        static const size_t exp_id = GetQuantileId(0.5);
+        MergedLimit best;
+        best.file_name = file_name;
+        best.mass = GetMass(file_name);
+        double best_exp = std::numeric_limits<double>::infinity();
+        for(size_t source_id = 0; source_id < sources.size(); ++source_id) {
+            const std::string full_name = FullName(sources.at(source_id), file_name);
+            if(!boost::filesystem::is_regular_file(full_name))
+                throw exception("File not found %1%") % full_name;
+            QuantileLimits limits = ReadLimitFile(full_name);
+            if(limits.at(exp_id).empty())
+                throw exception("Expected limit is not found in '%1%'.") % full_name;
+            const double exp = limits.at(exp_id).back();
+            if(source_id == 0 || exp < best_exp) {
+                best_exp = exp;
+                best.source_id = source_id;
+                best.limits = std::move(limits);
+            }
+        }
+        return best;
+    }
+
+    static double GetMass(const std::string& file_name)
+    {
+        try {
+            return GetHiggsMass(file_name);
+        } catch(analysis::exception&) {}
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+
+    static double GetLimit(const MergedLimit& merged, size_t quantile_id)
+    {
+        const auto& limits = merged.limits.at(quantile_id);
+        return limits.empty() ? std::numeric_limits<double>::quiet_NaN() : limits.back();
+    }
+
+    static void PrintSummary(const std::vector<std::string>& sources, const std::vector<MergedLimit>& merged)
+    {
+        static const size_t exp_id = GetQuantileId(0.5);
+        size_t max_name_length = 4;
+        for(const auto& entry : merged)
+            max_name_length = std::max(max_name_length, entry.file_name.size());
+        const std::string line_format = boost::str(boost::format("%%-%1%s%%-20s%%s") % (max_name_length + 4));
+        std::cout << boost::format(line_format) % "File" % "Exp limit" % "Source" << "\n";
+        for(const auto& entry : merged) {
+            std::ostringstream ss_limit;
+            ss_limit << GetLimit(entry, exp_id);
+            std::cout << boost::format(line_format) % entry.file_name % ss_limit.str() % sources.at(entry.source_id)
+                      << "\n";
+        }
+        std::cout.flush();
+    }
+
+    // All entries of the selected files in the format of the combine limit tree.
+    static void WriteMergedTree(const std::string& file_name, const std::vector<MergedLimit>& merged)
+    {
+        auto file = root_ext::CreateRootFile(file_name);
+        TTree* tree = new TTree("limit", "limit");
+        tree->SetDirectory(file.get());
+        double limit, mh;
+        float quantile_expected;
+        Int_t file_id;
+        tree->Branch("limit", &limit, "limit/D");
+        tree->Branch("quantileExpected", &quantile_expected, "quantileExpected/F");
+        tree->Branch("mh", &mh, "mh/D");
+        tree->Branch("file_id", &file_id, "file_id/I");
+        for(size_t n = 0; n < merged.size(); ++n) {
+            mh = merged.at(n).mass;
+            file_id = static_cast<Int_t>(n);
+            for(size_t quantile_id = 0; quantile_id < all_limit_quantiles.size(); ++quantile_id) {
+                quantile_expected = static_cast<float>(all_limit_quantiles.at(quantile_id));
+                for(double value : merged.at(n).limits.at(quantile_id)) {
+                    limit = value;
+                    tree->Fill();
+                }
+            }
+        }
+        file->WriteTObject(tree, nullptr, "Overwrite");
+        std::cout << "Merged limit tree is written into '" << file_name << "'." << std::endl;
+    }
+
+    // One entry per limit file with a column per quantile. Quantiles that are not available are set to NaN.
+    static void WriteSummary(const std::string& file_name, const std::vector<std::string>& sources,
+                             const std::vector<MergedLimit>& merged)
+    {
+        static const std::vector<std::string> branch_names = { "obs", "exp_m2", "exp_m1", "exp0", "exp_p1",
+                                                                "exp_p2" };
+        size_t max_name_length = 1;
+        for(const auto& entry : merged)
+            max_name_length = std::max(max_name_length, entry.file_name.size() + 1);
+        for(const auto& source : sources)
+            max_name_length = std::max(max_name_length, source.size() + 1);
+
+        auto file = root_ext::CreateRootFile(file_name);
+        TTree* tree = new TTree("summary", "summary");
+        tree->SetDirectory(file.get());
+        std::vector<char> name(max_name_length), source(max_name_length);
+        double mass;
+        std::vector<double> limits(all_limit_quantiles.size());
+        tree->Branch("file", name.data(), "file/C");
+        tree->Branch("source", source.data(), "source/C");
+        tree->Branch("mass", &mass, "mass/D");
+        for(size_t n = 0; n < limits.size(); ++n)
+            tree->Branch(branch_names.at(n).c_str(), &limits.at(n), (branch_names.at(n) + "/D").c_str());
+        for(const auto& entry : merged) {
+            std::fill(name.begin(), name.end(), '\0');
+            std::fill(source.begin(), source.end(), '\0');
+            std::copy(entry.file_name.begin(), entry.file_name.end(), name.begin());
+            const std::string& source_name = sources.at(entry.source_id);
+            std::copy(source_name.begin(), source_name.end(), source.begin());
+            mass = entry.mass;
+            for(size_t n = 0; n < limits.size(); ++n)
+                limits.at(n) = GetLimit(entry, n);
+            tree->Fill();
+        }
+        file->WriteTObject(tree, nullptr, "Overwrite");
+        std::cout << "Limit summary is written into '" << file_name << "'." << std::endl;
+    }
+
+private:
+    Arguments args;
+    ThreadPool pool;
+};
+
+} // namespace hh_analysis
+
+PROGRAM_MAIN(hh_analysis::MergeHHLimits, hh_analysis::Arguments)
@@ -1,78 +1,46 @@
 /*! Tool that provides a simple division-based HH model-dependent interpretation.
 This file is part of https://github.com/cms-hh/HHStatAnalysis. */
 
-#include <boost/regex.hpp>
-#include <boost/filesystem.hpp>
+#include <set>
+#include <tuple>
+#include <chrono>
+#include <thread>
 #include <TFile.h>
 #include <TTree.h>
+#include <TTreeReader.h>
+#include <TTreeReaderValue.h>
 #include <TH2.h>
+#include <TGraph.h>
 #include <TGraph2D.h>
-#include <Math/Interpolator.h>
 #include "HHStatAnalysis/Core/interface/program_main.h"
 #include "HHStatAnalysis/Core/interface/exception.h"
 #include "HHStatAnalysis/Core/interface/EnumNameMap.h"
 #include "HHStatAnalysis/Core/interface/NumericPrimitives.h"
 #include "HHStatAnalysis/Core/interface/RootExt.h"
+#include "HHStatAnalysis/Core/interface/ConfigReader.h"
+#include "HHStatAnalysis/StatModels/interface/GridInterpolator.h"
+#include "HHStatAnalysis/StatModels/interface/DelaunayTriangulation.h"
+#include "HHStatAnalysis/StatModels/interface/ContourExtractor.h"
+#include "HHStatAnalysis/StatModels/interface/AdaptiveGridScan.h"
+#include "HHStatAnalysis/StatModels/interface/KdTree.h"
+#include "HHStatAnalysis/StatModels/interface/SplineInterpolator.h"
+#include "HHStatAnalysis/StatModels/interface/ThreadPool.h"
+#include "HHStatAnalysis/StatModels/interface/CombineLimits.h"
 
 namespace hh_analysis {
 using namespace analysis;
+using namespace combine_limits;
 using StrVec = std::vector<std::string>;
-using InterpolatorPtr = std::shared_ptr<ROOT::Math::Interpolator> ;
-
-const std::vector<double> all_limit_quantiles = { -1., 0.025, 0.16, 0.5, 0.84, 0.975 };
-const StrVec all_limit_quantile_names = { "obs", "exp-2", "exp-1", "exp0", "exp+1", "exp+2" };
-
-size_t GetQuantileId(double quantile)
-{
-    static const double delta = 0.01;
-    for(size_t n = 0; n < all_limit_quantiles.size(); ++n) {
-        if(std::abs(all_limit_quantiles[n] - quantile) < delta)
-            return n;
-    }
-    throw exception("Unknown quantile = %1%") % quantile;
-}
-
-double GetHiggsMass(const std::string& file_name)
-{
-    static const StrVec mass_patterns = { "mR([0-9]*)", "mH([0-9]*)" };
-    for(const auto& pattern_str : mass_patterns) {
-        const boost::regex pattern(pattern_str);
-        boost::smatch mass_match;
-        if(boost::regex_search(file_name, mass_match, pattern)) {
-            std::istringstream ss_mass(mass_match[1]);
-            double mass;
-            ss_mass >> mass;
-            return mass;
-        }
-    }
-    throw exception("Bad file name %1%") % file_name;
-}
-
-std::set<std::pair<double, std::string>> GetOrderedFileList(const std::string& input_dir_name,
-                                                            const std::string& pattern_str)
-{
-    using namespace boost::filesystem;
-    std::set<std::pair<double, std::string>> files;
-    const boost::regex pattern(pattern_str);
-    const path input_dir(input_dir_name);
-    const directory_iterator end_iter;
-    for(directory_iterator file_iter(input_dir); file_iter != end_iter; ++file_iter) {
-        const auto& name = file_iter->path().string();
-        if(is_regular_file(file_iter->path()) && boost::regex_match(name, pattern))
-            files.insert(std::make_pair(GetHiggsMass(name), name));
-    }
-    return files;
-}
 
 enum class Particle { H, A, h };
 ENUM_NAMES(Particle) = {
     { Particle::H, "H" }, { Particle::A, "A" }, { Particle::h, "h" }
 };
 
-enum class Process { gg_H, H_hh, h_gammagamma, h_bb, h_tautau };
+enum class Process { gg_H, H_hh, h_gammagamma, h_bb, h_tautau, h_WW };
 ENUM_NAMES(Process) = {
     { Process::gg_H, "gg->H" }, { Process::H_hh, "H->hh" }, { Process::h_gammagamma, "h->gammagamma" },
-    { Process::h_bb, "h->bb" }, { Process::h_tautau, "h->tautau" }
+    { Process::h_bb, "h->bb" }, { Process::h_tautau, "h->tautau" }, { Process::h_WW, "h->WW" }
 };
 
 enum class Units { pb, fb };
@@ -80,10 +48,14 @@ ENUM_NAMES(Units) = {
     { Units::pb, "pb" }, { Units::fb, "fb" }
 };
 
-enum class CompositProcess { ggH_hh_bbtautau, ggH_hh_bbgammagamma };
-ENUM_NAMES(CompositProcess) = {
-    { CompositProcess::ggH_hh_bbtautau, "ggH_hh_bbtautau" },
-    { CompositProcess::ggH_hh_bbgammagamma, "ggH_hh_bbgammagamma" },
+enum class InterpolationMethod { None, Delaunay, Bilinear, Bicubic };
+ENUM_NAMES(SplineMethod) = {
+    { SplineMethod::Cubic, "cspline" }, { SplineMethod::Akima, "akima" }, { SplineMethod::Pchip, "pchip" }
+};
+
+ENUM_NAMES(InterpolationMethod) = {
+    { InterpolationMethod::None, "none" }, { InterpolationMethod::Delaunay, "delaunay" },
+    { InterpolationMethod::Bilinear, "bilinear" }, { InterpolationMethod::Bicubic, "bicubic" }
 };
 
 ENUM_OSTREAM_OPERATORS()
@@ -99,83 +71,280 @@ double GetUnitsFactor(Units units)
     return units_factors.at(units);
 }
 
+class PointColumn {
+public:
+    explicit PointColumn(bool _single_precision = false) : single_precision(_single_precision) {}
+
+    bool IsSinglePrecision() const { return single_precision; }
+    size_t size() const { return single_precision ? values_float.size() : values_double.size(); }
+
+    void reserve(size_t n)
+    {
+        if(single_precision)
+            values_float.reserve(n);
+        else
+            values_double.reserve(n);
+    }
+
+    void push_back(double value)
+    {
+        if(single_precision)
+            values_float.push_back(static_cast<float>(value));
+        else
+            values_double.push_back(value);
+    }
+
+    double at(size_t n) const { return single_precision ? values_float.at(n) : values_double.at(n); }
+
+    // out[n] *= column[offset + n] for n in [0, n_points). Plain contiguous loops, so that the compiler can
+    // vectorize them.
+    void MultiplyInto(double* out, size_t offset, size_t n_points) const
+    {
+        if(offset + n_points > size())
+            throw exception("Column range [%1%, %2%) is out of the column size = %3%.") % offset
+                % (offset + n_points) % size();
+        if(single_precision) {
+            const float* values = values_float.data() + offset;
+            for(size_t n = 0; n < n_points; ++n)
+                out[n] *= values[n];
+        } else {
+            const double* values = values_double.data() + offset;
+            for(size_t n = 0; n < n_points; ++n)
+                out[n] *= values[n];
+        }
+    }
+
+private:
+    bool single_precision;
+    std::vector<float> values_float;
+    std::vector<double> values_double;
+};
+
+// Composite process defined as a product expression of constant factors, cross sections xs(<process>) and
+// branching ratios br(<process>) of the elementary processes, e.g. "2 * xs(gg->H) * br(H->hh) * br(h->bb)".
+// The expression is parsed once: all constants are folded into a single factor and the remaining terms
+// are stored as the lists of columns that should be multiplied.
+class CompositProcess {
+public:
+    CompositProcess() : factor(1) {}
+
+    CompositProcess(const std::string& _name, const std::string& _expression)
+        : name(_name), expression(_expression), factor(1)
+    {
+        for(std::string term : SplitValueList(expression, true, "*", false)) {
+            boost::trim(term);
+            if(!term.size())
+                throw exception("Empty term in the expression '%1%' of the process '%2%'.") % expression % name;
+            if(term.back() == ')' && (term.find("xs(") == 0 || term.find("br(") == 0)) {
+                const std::string process_name = boost::trim_copy(term.substr(3, term.size() - 4));
+                Process process;
+                if(!EnumNameMap<Process>::GetDefault().TryParse(process_name, process))
+                    throw exception("Unknown process '%1%' in the expression '%2%' of the process '%3%'.")
+                        % process_name % expression % name;
+                if(term.front() == 'x')
+                    cross_sections.push_back(process);
+                else
+                    branching_ratios.push_back(process);
+                continue;
+            }
+            try {
+                factor *= Parse<double>(term);
+            } catch(analysis::exception&) {
+                throw exception("Invalid term '%1%' in the expression '%2%' of the process '%3%'.") % term
+                    % expression % name;
+            }
+        }
+    }
+
+    const std::string& GetName() const { return name; }
+    const std::string& GetExpression() const { return expression; }
+    double GetFactor() const { return factor; }
+    const std::vector<Process>& GetCrossSections() const { return cross_sections; }
+    const std::vector<Process>& GetBranchingRatios() const { return branching_ratios; }
+
+private:
+    std::string name, expression;
+    double factor;
+    std::vector<Process> cross_sections, branching_ratios;
+};
+
+std::ostream& operator<<(std::ostream& s, const CompositProcess& process)
+{
+    s << process.GetName();
+    return s;
+}
+
+// Predefined processes together with the processes defined by the user in format "name=expression;...".
+// User definitions can override the predefined ones.
+class CompositProcessCatalog {
+public:
+    explicit CompositProcessCatalog(const std::string& user_definitions = "")
+    {
+        static const std::vector<std::pair<std::string, std::string>> predefined = {
+            { "ggH_hh_bbtautau", "2 * xs(gg->H) * br(H->hh) * br(h->bb) * br(h->tautau)" },
+            { "ggH_hh_bbgammagamma", "2 * xs(gg->H) * br(H->hh) * br(h->bb) * br(h->gammagamma)" },
+            { "ggH_hh_bbWW", "2 * xs(gg->H) * br(H->hh) * br(h->bb) * br(h->WW)" },
+            { "ggH_hh_bbbb", "xs(gg->H) * br(H->hh) * br(h->bb) * br(h->bb)" },
+        };
+        for(const auto& entry : predefined)
+            Add(CompositProcess(entry.first, entry.second));
+        if(!user_definitions.size()) return;
+        for(const std::string& definition : SplitValueList(user_definitions, true, ";", true)) {
+            const size_t pos = definition.find('=');
+            if(pos == std::string::npos)
+                throw exception("Invalid process definition '%1%'. Expected format is name=expression.")
+                    % definition;
+            const std::string name = boost::trim_copy(definition.substr(0, pos));
+            if(!name.size())
+                throw exception("Process name is missing in the definition '%1%'.") % definition;
+            Add(CompositProcess(name, definition.substr(pos + 1)));
+        }
+    }
+
+    const CompositProcess& Get(const std::string& name) const
+    {
+        const auto iter = processes.find(name);
+        if(iter == processes.end())
+            throw exception("Unknown process '%1%'.") % name;
+        return iter->second;
+    }
+
+private:
+    void Add(const CompositProcess& process) { processes[process.GetName()] = process; }
+
+private:
+    std::map<std::string, CompositProcess> processes;
+};
+
+class ModelReader;
+
 class Model {
 public:
     typedef std::vector<double> Point;
-    typedef std::map<Particle, double> ParticleParamMap;
-    typedef std::map<Process, double> ProcessParamMap;
 
-    struct PointDescriptor {
-        Point point;
-        ParticleParamMap masses;
-        ProcessParamMap cross_sections, branching_ratios;
-        const Model* model;
+    // Structure-of-arrays storage of the model points: one contiguous column per coordinate and per model quantity.
+    class PointCollection {
+    public:
+        typedef std::map<Particle, PointColumn> ParticleColumnMap;
+        typedef std::map<Process, PointColumn> ProcessColumnMap;
+
+        PointCollection() : single_precision(false) {}
+        PointCollection(size_t n_dim, bool _single_precision)
+            : coordinates(n_dim, PointColumn(_single_precision)), single_precision(_single_precision) {}
 
-        const std::string& GetParamName(size_t dim) const
+        size_t size() const { return coordinates.size() ? coordinates.front().size() : 0; }
+        size_t GetNumberOfDimensions() const { return coordinates.size(); }
+        bool IsSinglePrecision() const { return single_precision; }
+
+        void Reserve(size_t n_points)
         {
-            if(!model)
-                throw exception("Model is not available.");
-            return model->GetParamName(dim);
+            for(auto& column : coordinates)
+                column.reserve(n_points);
+            ReserveAll(masses, n_points);
+            ReserveAll(cross_sections, n_points);
+            ReserveAll(branching_ratios, n_points);
         }
 
-        std::string GetParamNameString() const
+        PointColumn& Coordinates(size_t dim) { return coordinates.at(dim); }
+        PointColumn& Masses(Particle particle) { return GetOrAdd(masses, particle); }
+        PointColumn& CrossSections(Process process) { return GetOrAdd(cross_sections, process); }
+        PointColumn& BranchingRatios(Process process) { return GetOrAdd(branching_ratios, process); }
+
+        const PointColumn& GetCoordinates(size_t dim) const
         {
-            if(!model)
-                throw exception("Model is not available.");
-            return model->GetParamNameString();
+            if(dim >= coordinates.size())
+                throw exception("Model points do not have coordinate %1%.") % dim;
+            return coordinates.at(dim);
         }
 
-        std::string ToString() const { return Model::VectorToString(point); }
+        const PointColumn& GetMasses(Particle particle) const
+        {
+            return GetColumn(masses, particle, "mass");
+        }
 
-        double GetMass(Particle particle) const
+        const PointColumn& GetCrossSections(Process process) const
         {
-            return GetValue(masses, particle, "mass");
+            return GetColumn(cross_sections, process, "cross section");
         }
 
-        double GetCrossSection(Process process) const
+        const PointColumn& GetBranchingRatios(Process process) const
         {
-            return GetValue(cross_sections, process, "cross section");
+            return GetColumn(branching_ratios, process, "branching ratio");
         }
 
-        double GetBranchingRatio(Process process) const
+        void GetPoint(size_t n, Point& point) const
         {
-            return GetValue(branching_ratios, process, "branching ratio");
+            point.resize(coordinates.size());
+            for(size_t dim = 0; dim < coordinates.size(); ++dim)
+                point[dim] = coordinates[dim].at(n);
         }
 
-        double GetProcessBR_CS(CompositProcess process) const
+        // Computes XS x BR of the composite process for all points. The involved columns are resolved once,
+        // then the points are processed in blocks small enough to stay in the L1 cache, so that the output is
+        // written in a single pass over the memory.
+        void ComputeProcessBR_CS(const CompositProcess& process, std::vector<double>& out) const
         {
-            if(process == CompositProcess::ggH_hh_bbgammagamma) {
-                return 2.0 * GetCrossSection(Process::gg_H)
-                           * GetBranchingRatio(Process::H_hh)
-                           * GetBranchingRatio(Process::h_bb)
-                           * GetBranchingRatio(Process::h_gammagamma);
-            }
-            else if(process == CompositProcess::ggH_hh_bbtautau) {
-                return 2.0 * GetCrossSection(Process::gg_H)
-                           * GetBranchingRatio(Process::H_hh)
-                           * GetBranchingRatio(Process::h_bb)
-                           * GetBranchingRatio(Process::h_tautau);
+            static const size_t block_size = 1024;
+            std::vector<const PointColumn*> columns;
+            for(Process p : process.GetCrossSections())
+                columns.push_back(&GetCrossSections(p));
+            for(Process p : process.GetBranchingRatios())
+                columns.push_back(&GetBranchingRatios(p));
+
+            const size_t n_points = size();
+            out.assign(n_points, process.GetFactor());
+            for(size_t begin = 0; begin < n_points; begin += block_size) {
+                const size_t n_block = std::min(block_size, n_points - begin);
+                for(const PointColumn* column : columns)
+                    column->MultiplyInto(out.data() + begin, begin, n_block);
             }
-            throw exception("Unsupported process '%1%'.") % process;
         }
 
     private:
         template<typename Map>
-        double GetValue(const Map& map, const typename Map::key_type& key, const std::string& param_name) const
+        PointColumn& GetOrAdd(Map& map, const typename Map::key_type& key)
+        {
+            auto iter = map.find(key);
+            if(iter == map.end())
+                iter = map.insert(std::make_pair(key, PointColumn(single_precision))).first;
+            return iter->second;
+        }
+
+        template<typename Map>
+        static const PointColumn& GetColumn(const Map& map, const typename Map::key_type& key,
+                                            const std::string& param_name)
         {
             if(!map.count(key))
-                throw exception("%1% %2% not found for the parameter phase space point %3% = %4%.")
-                            % key % param_name % GetParamNameString() % ToString();
+                throw exception("%1% %2% is not available for the model points.") % key % param_name;
             return map.at(key);
         }
+
+        template<typename Map>
+        static void ReserveAll(Map& map, size_t n_points)
+        {
+            for(auto& entry : map)
+                entry.second.reserve(n_points);
+        }
+
+    private:
+        std::vector<PointColumn> coordinates;
+        ParticleColumnMap masses;
+        ProcessColumnMap cross_sections, branching_ratios;
+        bool single_precision;
     };
 
-    typedef std::list<PointDescriptor> PointDescriptorCollection;
+    using Range = ::analysis::Range<double>;
+    using RangeMultiD = ::analysis::RangeMultiD<Range>;
+    using ChunkCallback = std::function<void(const PointCollection&)>;
+
+    Model(const StrVec& _param_names, std::shared_ptr<const ModelReader> _reader)
+        : param_names(_param_names), param_names_str(VectorToString(_param_names)), reader(_reader) {}
+    virtual ~Model() {}
 
-    Model(const StrVec& _param_names)
-        : param_names(_param_names), param_names_str(VectorToString(_param_names)) {}
+    // Passes the model points to the callback in one or more chunks. Points outside of the parameter range
+    // can be skipped by the reader.
+    void ReadPoints(size_t chunk_size, const RangeMultiD& param_range, const ChunkCallback& callback) const;
 
-    const PointDescriptorCollection& GetAvailablePoints() const { return points; }
     size_t GetNumberOfDimensions() const { return param_names.size(); }
 
     const std::string& GetParamName(size_t dim) const
@@ -193,76 +362,81 @@ public:
         return "(" + CollectionToString(v) + ")";
     }
 
-protected:
-    PointDescriptorCollection points;
-
 private:
     StrVec param_names;
     std::string param_names_str;
+    std::shared_ptr<const ModelReader> reader;
 };
 
 class ModelReader {
 public:
     virtual ~ModelReader() {}
-    virtual Model::PointDescriptorCollection CollectAvailablePoints() const = 0;
+    virtual void ReadPoints(const StrVec& param_names, size_t chunk_size, const Model::RangeMultiD& param_range,
+                            const Model::ChunkCallback& callback) const = 0;
     virtual std::shared_ptr<TH2F> GetReferenceHistogram() const = 0;
 };
 
+void Model::ReadPoints(size_t chunk_size, const RangeMultiD& param_range, const ChunkCallback& callback) const
+{
+    reader->ReadPoints(param_names, chunk_size, param_range, callback);
+}
+
+// Names of the model quantities for each model file version.
+const std::map<Particle, StrVec>& GetMassDictionary()
+{
+    static const std::map<Particle, StrVec> dictionary {
+        { Particle::H, { "h_mH", "m_H", "mH", "m_H" } },
+        { Particle::A, { "h_mA", "m_A", "mA", "m_A" } },
+        { Particle::h, { "h_mh", "m_h", "mh", "m_h" } }
+    };
+    return dictionary;
+}
+
+const std::map<Process, StrVec>& GetCrossSectionDictionary()
+{
+    static const std::map<Process, StrVec> dictionary {
+        { Process::gg_H, { "h_ggF_xsec_H", "xs_gg_H", "xs_ggH", "xs_gg_H" } }
+    };
+    return dictionary;
+}
+
+const std::map<Process, StrVec>& GetBranchingRatioDictionary()
+{
+    static const std::map<Process, StrVec> dictionary {
+        { Process::H_hh, { "h_brh0h0_H", "br_H_hh", "br_Hhh", "br_H_hh" } },
+        { Process::h_gammagamma, { "h_brgammagamma_h", "br_h_gamgam", "br_hgammagamma", "br_h_gamgam" } },
+        { Process::h_bb, { "h_brbb_h", "br_h_bb", "br_hbb", "br_h_bb" } },
+        { Process::h_tautau, { "h_brtautau_h", "br_h_tautau", "br_htautau", "br_h_tautau" } },
+        { Process::h_WW, { "h_brWW_h", "br_h_WW", "br_hWW", "br_h_WW" } }
+    };
+    return dictionary;
+}
+
 template<typename _Histogram>
 class ModelReader_Hist2D : public ModelReader {
 public:
     typedef _Histogram Hist;
     typedef std::shared_ptr<Hist> HistPtr;
 
-    ModelReader_Hist2D(const std::string& file_name, size_t _version)
-        : file(new TFile(file_name.c_str(), "READ")), version(_version)
+    ModelReader_Hist2D(const std::string& file_name, size_t _version, bool _single_precision)
+        : file(new TFile(file_name.c_str(), "READ")), version(_version), single_precision(_single_precision)
     {
-        static const std::map<Particle, std::vector<std::string>> Mass_dictionary {
-            { Particle::H, { "h_mH", "m_H", "mH" } },
-            { Particle::A, { "h_mA", "m_A", "mA" } },
-            { Particle::h, { "h_mh", "m_h", "mh" } }
-        };
-
-        static const std::map<Process, std::vector<std::string>> CS_dictionary {
-            { Process::gg_H, { "h_ggF_xsec_H", "xs_gg_H", "xs_ggH" } }
-        };
-
-        static const std::map<Process, std::vector<std::string>> BR_dictionary {
-            { Process::H_hh, { "h_brh0h0_H", "br_H_hh", "br_Hhh" } },
-            { Process::h_gammagamma, { "h_brgammagamma_h", "br_h_gamgam", "br_hgammagamma" } },
-            { Process::h_bb, { "h_brbb_h", "br_h_bb", "br_hbb" } },
-            { Process::h_tautau, { "h_brtautau_h", "br_h_tautau", "br_htautau" } }
-        };
-
-        ReadAllHistograms(Mass_dictionary, masses);
-        ReadAllHistograms(CS_dictionary, cross_sections);
-        ReadAllHistograms(BR_dictionary, branching_ratios);
+        ReadAllHistograms(GetMassDictionary(), masses);
+        ReadAllHistograms(GetCrossSectionDictionary(), cross_sections);
+        ReadAllHistograms(GetBranchingRatioDictionary(), branching_ratios);
         if(!all_hists.size())
             throw exception("No histograms is read.");
         if(!CheckHistsCompatibility(all_hists))
             throw exception("Not all model histograms have compatible binning");
+        points = CollectAvailablePoints();
     }
 
-    virtual Model::PointDescriptorCollection CollectAvailablePoints() const override
+    // The grid is small enough to be kept in memory, so all points are passed as a single chunk.
+    virtual void ReadPoints(const StrVec& /*param_names*/, size_t /*chunk_size*/,
+                            const Model::RangeMultiD& /*param_range*/,
+                            const Model::ChunkCallback& callback) const override
     {
-        Model::PointDescriptorCollection points;
-        const auto ref_hist = *all_hists.begin();
-        for(Int_t x_id = 1; x_id <= ref_hist->GetXaxis()->GetNbins(); ++x_id) {
-            const double x = ref_hist->GetXaxis()->GetBinCenter(x_id);
-            for(Int_t y_id = 1; y_id <= ref_hist->GetYaxis()->GetNbins(); ++y_id) {
-                const double y = ref_hist->GetYaxis()->GetBinCenter(y_id);
-                Model::PointDescriptor desc;
-                desc.point = Model::Point({x, y});
-                for(const auto& entry : masses)
-                    desc.masses[entry.first] = entry.second->GetBinContent(x_id, y_id);
-                for(const auto& entry : cross_sections)
-                    desc.cross_sections[entry.first] = entry.second->GetBinContent(x_id, y_id);
-                for(const auto& entry : branching_ratios)
-                    desc.branching_ratios[entry.first] = entry.second->GetBinContent(x_id, y_id);
-                points.push_back(desc);
-            }
-        }
-        return points;
+        callback(points);
     }
 
     virtual std::shared_ptr<TH2F> GetReferenceHistogram() const override
@@ -271,27 +445,59 @@ public:
     }
 
 private:
-    HistPtr GetHist(const std::string& hist_name) const
+    Model::PointCollection CollectAvailablePoints() const
     {
-        HistPtr hist(dynamic_cast<Hist*>(file->Get(hist_name.c_str())));
-        if(!hist)
-            throw exception("Can't read histogram '%1%' from model file '%2%'.")
-                % hist_name % file->GetName();
-        return hist;
+        const auto ref_hist = *all_hists.begin();
+        const Int_t n_x = ref_hist->GetXaxis()->GetNbins(), n_y = ref_hist->GetYaxis()->GetNbins();
+        Model::PointCollection points(2, single_precision);
+        for(const auto& entry : masses)
+            points.Masses(entry.first);
+        for(const auto& entry : cross_sections)
+            points.CrossSections(entry.first);
+        for(const auto& entry : branching_ratios)
+            points.BranchingRatios(entry.first);
+        points.Reserve(static_cast<size_t>(n_x) * static_cast<size_t>(n_y));
+
+        for(Int_t x_id = 1; x_id <= n_x; ++x_id) {
+            const double x = ref_hist->GetXaxis()->GetBinCenter(x_id);
+            for(Int_t y_id = 1; y_id <= n_y; ++y_id) {
+                points.Coordinates(0).push_back(x);
+                points.Coordinates(1).push_back(ref_hist->GetYaxis()->GetBinCenter(y_id));
+            }
+        }
+        FillColumns(masses, n_x, n_y, [&](Particle p) -> PointColumn& { return points.Masses(p); });
+        FillColumns(cross_sections, n_x, n_y, [&](Process p) -> PointColumn& { return points.CrossSections(p); });
+        FillColumns(branching_ratios, n_x, n_y,
+                    [&](Process p) -> PointColumn& { return points.BranchingRatios(p); });
+        return points;
     }
 
+    // Quantities that are not present in the model file are not available for the model points.
     template<typename NameMap, typename OutputMap>
     void ReadAllHistograms(const NameMap& dictionary, OutputMap& values)
     {
         for(const auto& entry : dictionary) {
             const std::string& hist_name = entry.second.at(version);
             if(!hist_name.size()) continue;
-            const auto hist = GetHist(hist_name);
+            HistPtr hist(dynamic_cast<Hist*>(file->Get(hist_name.c_str())));
+            if(!hist) continue;
             values[entry.first] = hist;
             all_hists.push_back(hist);
         }
     }
 
+    template<typename HistMap, typename ColumnGetter>
+    static void FillColumns(const HistMap& hists, Int_t n_x, Int_t n_y, const ColumnGetter& get_column)
+    {
+        for(const auto& entry : hists) {
+            PointColumn& column = get_column(entry.first);
+            for(Int_t x_id = 1; x_id <= n_x; ++x_id) {
+                for(Int_t y_id = 1; y_id <= n_y; ++y_id)
+                    column.push_back(entry.second->GetBinContent(x_id, y_id));
+            }
+        }
+    }
+
     template<typename HistContainer>
     static bool CheckHistsCompatibility(const HistContainer& hists)
     {
@@ -324,18 +530,154 @@ private:
 private:
     std::shared_ptr<TFile> file;
     size_t version;
+    bool single_precision;
     std::map<Particle, HistPtr> masses;
     std::map<Process, HistPtr> cross_sections, branching_ratios;
     std::list<HistPtr> all_hists;
+    Model::PointCollection points;
+};
+
+// Model points are stored as entries of the "points" tree: one branch of type double per model parameter
+// (named as the parameter, e.g. m_A and tan_beta) and per model quantity.
+// The tree is read in chunks of a fixed size and points outside of the parameter range are skipped during the
+// reading, so the memory usage does not depend on the size of the scan.
+// Points are scattered, therefore the binning of the output histograms is defined by the grid ranges:
+// bins are centred on the grid points.
+class ModelReader_Tree : public ModelReader {
+public:
+    using GridRange = RangeWithStep<double>;
+
+    ModelReader_Tree(const std::string& file_name, size_t _version, bool _single_precision,
+                     const GridRange& _grid_x, const GridRange& _grid_y)
+        : file(root_ext::OpenRootFile(file_name)), version(_version), single_precision(_single_precision),
+          grid_x(_grid_x), grid_y(_grid_y)
+    {
+        tree = dynamic_cast<TTree*>(file->Get(TreeName().c_str()));
+        if(!tree)
+            throw exception("Tree '%1%' not found in model file '%2%'.") % TreeName() % file_name;
+        CollectBranches(GetMassDictionary(), masses);
+        CollectBranches(GetCrossSectionDictionary(), cross_sections);
+        CollectBranches(GetBranchingRatioDictionary(), branching_ratios);
+        if(masses.empty() && cross_sections.empty() && branching_ratios.empty())
+            throw exception("Model file '%1%' doesn't contain any model quantity.") % file_name;
+        if(!(grid_x.step() > 0) || !(grid_y.step() > 0))
+            throw exception("Grid ranges should be specified for the model file '%1%'.") % file_name;
+    }
+
+    static const std::string& TreeName() { static const std::string name = "points"; return name; }
+
+    virtual void ReadPoints(const StrVec& param_names, size_t chunk_size, const Model::RangeMultiD& param_range,
+                            const Model::ChunkCallback& callback) const override
+    {
+        using Value = TTreeReaderValue<double>;
+        using ValuePtr = std::shared_ptr<Value>;
+
+        if(!chunk_size)
+            throw exception("Chunk size should be positive.");
+
+        // The same tree can be shared by several jobs.
+        std::lock_guard<std::mutex> lock(mutex);
+        TTreeReader reader(tree);
+        std::vector<ValuePtr> coordinates;
+        for(const auto& name : param_names) {
+            if(!tree->GetBranch(name.c_str()))
+                throw exception("Model parameter '%1%' is not found in the model tree.") % name;
+            coordinates.push_back(std::make_shared<Value>(reader, name.c_str()));
+        }
+        std::vector<std::pair<Particle, ValuePtr>> mass_values;
+        for(const auto& entry : masses)
+            mass_values.emplace_back(entry.first, std::make_shared<Value>(reader, entry.second.c_str()));
+        std::vector<std::pair<Process, ValuePtr>> cs_values, br_values;
+        for(const auto& entry : cross_sections)
+            cs_values.emplace_back(entry.first, std::make_shared<Value>(reader, entry.second.c_str()));
+        for(const auto& entry : branching_ratios)
+            br_values.emplace_back(entry.first, std::make_shared<Value>(reader, entry.second.c_str()));
+
+        std::shared_ptr<Model::PointCollection> chunk;
+        Model::Point point(param_names.size());
+        while(reader.Next()) {
+            for(size_t dim = 0; dim < coordinates.size(); ++dim)
+                point[dim] = **coordinates[dim];
+            if(!param_range.Contains(point)) continue;
+            if(!chunk)
+                chunk = CreateChunk(param_names.size(), chunk_size);
+            for(size_t dim = 0; dim < point.size(); ++dim)
+                chunk->Coordinates(dim).push_back(point[dim]);
+            for(const auto& entry : mass_values)
+                chunk->Masses(entry.first).push_back(**entry.second);
+            for(const auto& entry : cs_values)
+                chunk->CrossSections(entry.first).push_back(**entry.second);
+            for(const auto& entry : br_values)
+                chunk->BranchingRatios(entry.first).push_back(**entry.second);
+            if(chunk->size() == chunk_size) {
+                callback(*chunk);
+                chunk.reset();
+            }
+        }
+        if(chunk)
+            callback(*chunk);
+    }
+
+    virtual std::shared_ptr<TH2F> GetReferenceHistogram() const override
+    {
+        const size_t n_x = grid_x.n_grid_points(), n_y = grid_y.n_grid_points();
+        std::shared_ptr<TH2F> hist(new TH2F("ref_hist", "ref_hist",
+                static_cast<Int_t>(n_x), grid_x.min() - grid_x.step() / 2, grid_x.grid_point_value(n_x - 1)
+                + grid_x.step() / 2, static_cast<Int_t>(n_y), grid_y.min() - grid_y.step() / 2,
+                grid_y.grid_point_value(n_y - 1) + grid_y.step() / 2));
+        hist->SetDirectory(nullptr);
+        return hist;
+    }
+
+private:
+    template<typename NameMap, typename BranchMap>
+    void CollectBranches(const NameMap& dictionary, BranchMap& branches) const
+    {
+        for(const auto& entry : dictionary) {
+            const std::string& branch_name = entry.second.at(version);
+            if(branch_name.size() && tree->GetBranch(branch_name.c_str()))
+                branches[entry.first] = branch_name;
+        }
+    }
+
+    std::shared_ptr<Model::PointCollection> CreateChunk(size_t n_dim, size_t chunk_size) const
+    {
+        auto chunk = std::make_shared<Model::PointCollection>(n_dim, single_precision);
+        for(const auto& entry : masses)
+            chunk->Masses(entry.first);
+        for(const auto& entry : cross_sections)
+            chunk->CrossSections(entry.first);
+        for(const auto& entry : branching_ratios)
+            chunk->BranchingRatios(entry.first);
+        chunk->Reserve(chunk_size);
+        return chunk;
+    }
+
+private:
+    std::shared_ptr<TFile> file;
+    TTree* tree;
+    size_t version;
+    bool single_precision;
+    GridRange grid_x, grid_y;
+    std::map<Particle, std::string> masses;
+    std::map<Process, std::string> cross_sections, branching_ratios;
+    mutable std::mutex mutex;
 };
 
 class ModelReaderFactory {
 public:
-    static std::shared_ptr<ModelReader> Make(const std::string& file_name, size_t version)
+    using GridRange = RangeWithStep<double>;
+
+    // Versions 0-2: grid of 2D histograms. Version 3: tree of scattered points.
+    static std::shared_ptr<ModelReader> Make(const std::string& file_name, size_t version, bool single_precision,
+                                             const GridRange& grid_x, const GridRange& grid_y)
     {
-        if(version >= 3)
-            throw exception("Model file version %1% is not supported.") % version;
-        return std::shared_ptr<ModelReader>(new ModelReader_Hist2D<TH2F>(file_name, version));
+        if(version < 3)
+            return std::shared_ptr<ModelReader>(new ModelReader_Hist2D<TH2F>(file_name, version, single_precision));
+        if(version == 3)
+            return std::shared_ptr<ModelReader>(new ModelReader_Tree(file_name, version, single_precision,
+                                                                     grid_x, grid_y));
+        throw exception("Model file version %1% is not supported.") % version;
     }
 private:
     ModelReaderFactory() {}
@@ -343,20 +685,14 @@ private:
 
 class Model_MSSM : public Model {
 public:
-    Model_MSSM(const PointDescriptorCollection& _points)
-        : Model({ "m_A", "tan_beta" })
-    {
-        points = _points;
-    }
+    Model_MSSM(std::shared_ptr<const ModelReader> reader)
+        : Model({ "m_A", "tan_beta" }, reader) {}
 };
 
 class Model_2HDM : public Model {
 public:
-    Model_2HDM(const PointDescriptorCollection& _points)
-        : Model({ "m_H", "tan_beta" })
-    {
-        points = _points;
-    }
+    Model_2HDM(std::shared_ptr<const ModelReader> reader)
+        : Model({ "m_H", "tan_beta" }, reader) {}
 };
 
 
@@ -364,11 +700,10 @@ class ModelFactory {
 public:
     static std::shared_ptr<Model> Make(const std::string& name, std::shared_ptr<ModelReader> reader)
     {
-        const auto points = reader->CollectAvailablePoints();
         if(name == "MSSM")
-            return std::shared_ptr<Model>(new Model_MSSM(points));
+            return std::shared_ptr<Model>(new Model_MSSM(reader));
         else if(name == "2HDM")
-            return std::shared_ptr<Model>(new Model_2HDM(points));
+            return std::shared_ptr<Model>(new Model_2HDM(reader));
         throw exception("Model name '%1%' is not supported.") % name;
     }
 
@@ -384,153 +719,1024 @@ std::shared_ptr<TGraph2D> CreateTGraph2D(const std::string& name, const std::vec
                                                   y_list_copy.data(), z_list_copy.data()));
 }
 
-std::shared_ptr<TH2D> CreateTH2D(const std::string& name, std::shared_ptr<TH2F> ref_hist)
+std::vector<double> GetBinEdges(const TAxis& axis, size_t upsample = 1)
+{
+    std::vector<double> edges;
+    for(Int_t n = 1; n <= axis.GetNbins(); ++n) {
+        const double low_edge = axis.GetBinLowEdge(n), width = axis.GetBinUpEdge(n) - low_edge;
+        for(size_t k = 0; k < upsample; ++k)
+            edges.push_back(low_edge + width * k / upsample);
+    }
+    edges.push_back(axis.GetBinUpEdge(axis.GetNbins()));
+    return edges;
+}
+
+std::vector<double> GetBinCenters(const std::vector<double>& edges)
+{
+    std::vector<double> centers;
+    for(size_t n = 1; n < edges.size(); ++n)
+        centers.push_back((edges[n - 1] + edges[n]) / 2);
+    return centers;
+}
+
+std::shared_ptr<TH2D> CreateTH2D(const std::string& name, std::shared_ptr<TH2F> ref_hist, size_t upsample = 1)
+{
+    const auto x_bins = GetBinEdges(*ref_hist->GetXaxis(), upsample);
+    const auto y_bins = GetBinEdges(*ref_hist->GetYaxis(), upsample);
+    return std::shared_ptr<TH2D>(new TH2D(name.c_str(), name.c_str(), x_bins.size() - 1, x_bins.data(),
+                                          y_bins.size() - 1, y_bins.data()));
+}
+
+// Interpolates values defined on the selected model points into the bins of the output histograms.
+// The part that depends only on the point positions (placement on the grid or triangulation) is prepared once
+// in the constructor and shared by all outputs. Interpolate can be called concurrently from several threads.
+class OutputInterpolator {
+public:
+    using ValueList = std::vector<double>;
+
+    OutputInterpolator(const TH2F& ref_hist, size_t upsample)
+        : x_centers(GetBinCenters(GetBinEdges(*ref_hist.GetXaxis(), upsample))),
+          y_centers(GetBinCenters(GetBinEdges(*ref_hist.GetYaxis(), upsample))) {}
+    virtual ~OutputInterpolator() {}
+
+    // Returns values in the output bins stored in x-major order. Bins without value are set to NaN.
+    virtual ValueList Interpolate(const ValueList& z_list) const = 0;
+
+protected:
+    std::vector<double> x_centers, y_centers;
+};
+
+class GridOutputInterpolator : public OutputInterpolator {
+public:
+    GridOutputInterpolator(const std::vector<double>& x_list, const std::vector<double>& y_list,
+                           const TH2F& ref_hist, size_t upsample, GridInterpolator::Method method)
+        : OutputInterpolator(ref_hist, upsample),
+          interpolator(GetBinCenters(GetBinEdges(*ref_hist.GetXaxis())),
+                       GetBinCenters(GetBinEdges(*ref_hist.GetYaxis())), method)
+    {
+        const TAxis& x_axis = *ref_hist.GetXaxis(), &y_axis = *ref_hist.GetYaxis();
+        for(size_t n = 0; n < x_list.size(); ++n) {
+            const Int_t x_id = x_axis.FindFixBin(x_list.at(n)), y_id = y_axis.FindFixBin(y_list.at(n));
+            if(x_id < 1 || x_id > x_axis.GetNbins() || y_id < 1 || y_id > y_axis.GetNbins())
+                throw exception("Point (%1%, %2%) is outside of the reference grid.") % x_list.at(n) % y_list.at(n);
+            node_indices.push_back(interpolator.GetIndex(x_id - 1, y_id - 1));
+        }
+    }
+
+    virtual ValueList Interpolate(const ValueList& z_list) const override
+    {
+        std::vector<double> node_values(interpolator.GetXNodes().size() * interpolator.GetYNodes().size(),
+                                        GridInterpolator::NaN());
+        for(size_t n = 0; n < node_indices.size(); ++n)
+            node_values[node_indices[n]] = z_list.at(n);
+        GridInterpolator grid(interpolator);
+        grid.SetValues(node_values);
+        return grid.Interpolate(x_centers, y_centers);
+    }
+
+private:
+    GridInterpolator interpolator;
+    std::vector<size_t> node_indices;
+};
+
+class DelaunayOutputInterpolator : public OutputInterpolator {
+public:
+    DelaunayOutputInterpolator(const std::vector<double>& x_list, const std::vector<double>& y_list,
+                               const TH2F& ref_hist, size_t upsample)
+        : OutputInterpolator(ref_hist, upsample)
+    {
+        const DelaunayTriangulation triangulation(x_list, y_list);
+        std::vector<double> x_bins, y_bins;
+        for(double x : x_centers) {
+            for(double y : y_centers) {
+                x_bins.push_back(x);
+                y_bins.push_back(y);
+            }
+        }
+        plan = triangulation.CreateInterpolationPlan(x_bins, y_bins);
+    }
+
+    virtual ValueList Interpolate(const ValueList& z_list) const override
+    {
+        return plan.Apply(z_list);
+    }
+
+private:
+    DelaunayTriangulation::InterpolationPlan plan;
+};
+
+std::shared_ptr<OutputInterpolator> CreateOutputInterpolator(InterpolationMethod interpolation,
+                                                             const std::vector<double>& x_list,
+                                                             const std::vector<double>& y_list,
+                                                             const TH2F& ref_hist, size_t upsample)
+{
+    if(interpolation == InterpolationMethod::Delaunay)
+        return std::make_shared<DelaunayOutputInterpolator>(x_list, y_list, ref_hist, upsample);
+    if(interpolation == InterpolationMethod::Bilinear)
+        return std::make_shared<GridOutputInterpolator>(x_list, y_list, ref_hist, upsample,
+                                                        GridInterpolator::Method::Bilinear);
+    if(interpolation == InterpolationMethod::Bicubic)
+        return std::make_shared<GridOutputInterpolator>(x_list, y_list, ref_hist, upsample,
+                                                        GridInterpolator::Method::Bicubic);
+    return std::shared_ptr<OutputInterpolator>();
+}
+
+// Values in the bins of the output histograms stored in x-major order. Bins without value are set to NaN.
+// Without the interpolator the output binning is the same as the binning of the reference histogram
+// and each point fills the bin where it is located.
+std::vector<double> ComputeBinValues(const TH2& ref_hist, const std::vector<double>& x_list,
+                                     const std::vector<double>& y_list, const std::vector<double>& z_list,
+                                     const OutputInterpolator* interpolator)
+{
+    if(interpolator)
+        return interpolator->Interpolate(z_list);
+    const TAxis& x_axis = *ref_hist.GetXaxis(), &y_axis = *ref_hist.GetYaxis();
+    const size_t n_y = static_cast<size_t>(y_axis.GetNbins());
+    std::vector<double> values(static_cast<size_t>(x_axis.GetNbins()) * n_y, GridInterpolator::NaN());
+    for(size_t n = 0; n < z_list.size(); ++n) {
+        const Int_t x_id = x_axis.FindFixBin(x_list.at(n)), y_id = y_axis.FindFixBin(y_list.at(n));
+        if(x_id < 1 || x_id > x_axis.GetNbins() || y_id < 1 || y_id > y_axis.GetNbins()) continue;
+        values.at(static_cast<size_t>(x_id - 1) * n_y + static_cast<size_t>(y_id - 1)) = z_list.at(n);
+    }
+    return values;
+}
+
+// Contour lines of the values in the output bins. Bin centers are used as the grid nodes.
+std::vector<ContourLine> ExtractContours(const TH2& ref_hist, size_t upsample, const std::vector<double>& bin_values,
+                                         double level)
+{
+    const auto x_nodes = GetBinCenters(GetBinEdges(*ref_hist.GetXaxis(), upsample));
+    const auto y_nodes = GetBinCenters(GetBinEdges(*ref_hist.GetYaxis(), upsample));
+    if(x_nodes.size() < 2 || y_nodes.size() < 2)
+        return std::vector<ContourLine>();
+    return ContourExtractor(x_nodes, y_nodes).Extract(bin_values, level);
+}
+
+// Each line is written as a separate TGraph with name prefix_k.
+void WriteContours(const std::string& prefix, const std::vector<ContourLine>& lines, TFile& output_file)
+{
+    for(size_t n = 0; n < lines.size(); ++n) {
+        const ContourLine& line = lines.at(n);
+        std::ostringstream ss_name;
+        ss_name << prefix << "_" << n;
+        TGraph graph(static_cast<Int_t>(line.size()), line.x.data(), line.y.data());
+        graph.SetName(ss_name.str().c_str());
+        graph.SetTitle(ss_name.str().c_str());
+        output_file.WriteTObject(&graph, nullptr, "Overwrite");
+    }
+}
+
+// Values of the histogram bins in x-major order together with the bin edges along each axis.
+struct BinGrid {
+    std::vector<double> x_edges, y_edges, values;
+
+    size_t GetNbinsX() const { return x_edges.size() - 1; }
+    size_t GetNbinsY() const { return y_edges.size() - 1; }
+};
+
+enum class BinMerge { Min, Max, Mean };
+
+// Each bin of the result covers 2x2 bins of the original grid (the last row or column can cover a single bin).
+// Bins without value (NaN) are ignored, the merged bin is NaN if none of the original bins has a value.
+BinGrid DownsampleGrid(const BinGrid& grid, BinMerge merge)
+{
+    BinGrid result;
+    for(size_t n = 0; n < grid.x_edges.size(); n += 2)
+        result.x_edges.push_back(grid.x_edges.at(n));
+    if(result.x_edges.back() != grid.x_edges.back())
+        result.x_edges.push_back(grid.x_edges.back());
+    for(size_t n = 0; n < grid.y_edges.size(); n += 2)
+        result.y_edges.push_back(grid.y_edges.at(n));
+    if(result.y_edges.back() != grid.y_edges.back())
+        result.y_edges.push_back(grid.y_edges.back());
+
+    const size_t n_x = grid.GetNbinsX(), n_y = grid.GetNbinsY(), n_y_result = result.GetNbinsY();
+    result.values.assign(result.GetNbinsX() * n_y_result, std::numeric_limits<double>::quiet_NaN());
+    for(size_t x_id = 0; x_id < result.GetNbinsX(); ++x_id) {
+        for(size_t y_id = 0; y_id < n_y_result; ++y_id) {
+            double merged = std::numeric_limits<double>::quiet_NaN();
+            size_t n_values = 0;
+            for(size_t i = 2 * x_id; i < std::min(2 * x_id + 2, n_x); ++i) {
+                for(size_t j = 2 * y_id; j < std::min(2 * y_id + 2, n_y); ++j) {
+                    const double value = grid.values.at(i * n_y + j);
+                    if(std::isnan(value)) continue;
+                    if(!n_values++)
+                        merged = value;
+                    else if(merge == BinMerge::Min)
+                        merged = std::min(merged, value);
+                    else if(merge == BinMerge::Max)
+                        merged = std::max(merged, value);
+                    else
+                        merged += value;
+                }
+            }
+            if(merge == BinMerge::Mean && n_values)
+                merged /= n_values;
+            result.values.at(x_id * n_y_result + y_id) = merged;
+        }
+    }
+    return result;
+}
+
+std::shared_ptr<TH2D> CreateTH2D(const std::string& name, const BinGrid& grid)
 {
-    const auto x_bins = ref_hist->GetXaxis()->GetXbins(), y_bins = ref_hist->GetYaxis()->GetXbins();
-    return std::shared_ptr<TH2D>(new TH2D(name.c_str(), name.c_str(), x_bins->GetSize() - 1, x_bins->GetArray(),
-                                          y_bins->GetSize() - 1, y_bins->GetArray()));
+    std::shared_ptr<TH2D> hist(new TH2D(name.c_str(), name.c_str(), grid.GetNbinsX(), grid.x_edges.data(),
+                                        grid.GetNbinsY(), grid.y_edges.data()));
+    for(size_t x_id = 0; x_id < grid.GetNbinsX(); ++x_id) {
+        for(size_t y_id = 0; y_id < grid.GetNbinsY(); ++y_id) {
+            const double value = grid.values.at(x_id * grid.GetNbinsY() + y_id);
+            if(!std::isnan(value))
+                hist->SetBinContent(static_cast<Int_t>(x_id + 1), static_cast<Int_t>(y_id + 1), value);
+        }
+    }
+    return hist;
 }
 
-void CreateOutput(const std::vector<double>& x_list, const std::vector<double>& y_list,
-                  const std::vector<double>& z_list, std::shared_ptr<TFile> output_file, const std::string& name,
-                  const std::shared_ptr<TH2F> ref_hist, double excl_threshold = -std::numeric_limits<double>::infinity(),
-                  double graph_factor = 1, double graph_max = std::numeric_limits<double>::infinity(),
-                  bool interpolate = false)
+TDirectory* GetOrCreateDirectory(TDirectory& parent, const std::string& name)
 {
-    std::ostringstream ss_name;
-    ss_name << name << "_hist";
-    auto hist = CreateTH2D(ss_name.str(), ref_hist);
-    ss_name << "_excl";
-    auto hist_excl = CreateTH2D(ss_name.str(), ref_hist);
-
-    if(interpolate) {
-        auto ref_graph = CreateTGraph2D("ref_tmp", x_list, y_list, z_list);
+    TDirectory* dir = parent.GetDirectory(name.c_str());
+    if(!dir)
+        dir = parent.mkdir(name.c_str());
+    if(!dir)
+        throw exception("Unable to create directory '%1%'.") % name;
+    return dir;
+}
+
+struct OutputDescriptor {
+    std::string name;
+    double excl_threshold, graph_factor, graph_max;
+
+    OutputDescriptor(const std::string& _name, double _excl_threshold = -std::numeric_limits<double>::infinity(),
+                     double _graph_factor = 1, double _graph_max = std::numeric_limits<double>::infinity())
+        : name(_name), excl_threshold(_excl_threshold), graph_factor(_graph_factor), graph_max(_graph_max) {}
+};
+
+// Output objects are created and written in the main thread, while the filling can be done concurrently.
+// If the exclusion threshold is defined, the exclusion contour at the threshold level is extracted as well.
+// Optionally, the output histogram is also written as a pyramid of downsampled levels into lod/level_<k>,
+// where each level is 2 times coarser along each axis than the previous one. For the r-values (outputs with
+// the exclusion threshold) each level contains the minimum and the maximum over the merged bins, so that
+// the excluded and the allowed regions are preserved. For other outputs the mean value is stored.
+class Output {
+public:
+    Output(const OutputDescriptor& _desc, const std::shared_ptr<TH2F> _ref_hist, size_t _upsample,
+           size_t _n_lod_levels = 0)
+        : desc(_desc), ref_hist(_ref_hist), upsample(_upsample), n_lod_levels(_n_lod_levels)
+    {
+        std::ostringstream ss_name;
+        ss_name << desc.name << "_hist";
+        hist = CreateTH2D(ss_name.str(), ref_hist, upsample);
+        ss_name << "_excl";
+        hist_excl = CreateTH2D(ss_name.str(), ref_hist, upsample);
+    }
+
+    // If the interpolator is provided, interpolated values are used to fill the output histograms,
+    // otherwise each point fills the bin where it is located.
+    void Fill(const std::vector<double>& x_list, const std::vector<double>& y_list, const std::vector<double>& z_list,
+              const OutputInterpolator* interpolator)
+    {
+        const auto z_bins = ComputeBinValues(*ref_hist, x_list, y_list, z_list, interpolator);
+        const Int_t n_y = hist->GetYaxis()->GetNbins();
         for(Int_t x_id = 1; x_id <= hist->GetXaxis()->GetNbins(); ++x_id) {
-            const double x = hist->GetXaxis()->GetBinCenter(x_id);
-            for(Int_t y_id = 1; y_id <= hist->GetYaxis()->GetNbins(); ++y_id) {
-                const double y = hist->GetYaxis()->GetBinCenter(y_id);
-                const double z = ref_graph->Interpolate(x, y);
+            for(Int_t y_id = 1; y_id <= n_y; ++y_id) {
+                const double z = z_bins.at(static_cast<size_t>((x_id - 1) * n_y + y_id - 1));
+                if(std::isnan(z)) continue;
                 hist->SetBinContent(x_id, y_id, z);
-                if(z < excl_threshold)
+                if(z < desc.excl_threshold)
                     hist_excl->SetBinContent(x_id, y_id, 1.0);
             }
         }
-    } else {
-        for(size_t n = 0; n < z_list.size(); ++n) {
-            const Int_t bin_id = hist->FindBin(x_list.at(n), y_list.at(n));
-            const double z =  z_list.at(n);
-            hist->SetBinContent(bin_id, z);
-            if(z < excl_threshold)
-                hist_excl->SetBinContent(bin_id, 1.0);
+        if(std::isfinite(desc.excl_threshold))
+            contours = ExtractContours(*ref_hist, upsample, z_bins, desc.excl_threshold);
+        if(n_lod_levels)
+            CreateLodLevels(z_bins);
+
+        z_list_graph.resize(z_list.size());
+        for(size_t n = 0; n < z_list.size(); ++n)
+            z_list_graph.at(n) = std::min(desc.graph_max, z_list.at(n) * desc.graph_factor);
+    }
+
+    void Write(const std::vector<double>& x_list, const std::vector<double>& y_list,
+               std::shared_ptr<TFile> output_file) const
+    {
+        auto graph = CreateTGraph2D(desc.name, x_list, y_list, z_list_graph);
+        output_file->WriteTObject(graph.get(), nullptr, "Overwrite");
+        output_file->WriteTObject(hist.get(), nullptr, "Overwrite");
+        output_file->WriteTObject(hist_excl.get(), nullptr, "Overwrite");
+        WriteContours(desc.name + "_contour", contours, *output_file);
+
+        for(size_t level = 1; level <= lod_levels.size(); ++level) {
+            std::ostringstream ss_dir;
+            ss_dir << "level_" << level;
+            TDirectory* dir = GetOrCreateDirectory(*GetOrCreateDirectory(*output_file, "lod"), ss_dir.str());
+            for(const auto& entry : lod_levels.at(level - 1)) {
+                auto lod_hist = CreateTH2D(desc.name + "_hist" + entry.first, entry.second);
+                dir->WriteTObject(lod_hist.get(), nullptr, "Overwrite");
+            }
         }
     }
 
-    std::vector<double> z_list_graph(z_list.size());
-    for(size_t n = 0; n < z_list.size(); ++n)
-        z_list_graph.at(n) = std::min(graph_max, z_list.at(n) * graph_factor);
-    auto graph = CreateTGraph2D(name, x_list, y_list, z_list_graph);
+private:
+    using LodLevel = std::vector<std::pair<std::string, BinGrid>>;
 
-    output_file->WriteTObject(graph.get(), nullptr, "Overwrite");
-    output_file->WriteTObject(hist.get(), nullptr, "Overwrite");
-    output_file->WriteTObject(hist_excl.get(), nullptr, "Overwrite");
-}
+    void CreateLodLevels(const std::vector<double>& z_bins)
+    {
+        std::vector<std::pair<std::string, BinMerge>> merges;
+        if(std::isfinite(desc.excl_threshold)) {
+            merges.push_back(std::make_pair("_min", BinMerge::Min));
+            merges.push_back(std::make_pair("_max", BinMerge::Max));
+        } else {
+            merges.push_back(std::make_pair("", BinMerge::Mean));
+        }
+
+        BinGrid full;
+        full.x_edges = GetBinEdges(*ref_hist->GetXaxis(), upsample);
+        full.y_edges = GetBinEdges(*ref_hist->GetYaxis(), upsample);
+        full.values = z_bins;
+        lod_levels.clear();
+        for(size_t level = 1; level <= n_lod_levels; ++level) {
+            LodLevel lod_level;
+            for(size_t n = 0; n < merges.size(); ++n) {
+                const BinGrid& previous = level == 1 ? full : lod_levels.back().at(n).second;
+                lod_level.push_back(std::make_pair(merges.at(n).first, DownsampleGrid(previous, merges.at(n).second)));
+            }
+            lod_levels.push_back(lod_level);
+            if(lod_level.front().second.GetNbinsX() == 1 && lod_level.front().second.GetNbinsY() == 1) break;
+        }
+    }
+
+private:
+    OutputDescriptor desc;
+    std::shared_ptr<TH2F> ref_hist;
+    size_t upsample, n_lod_levels;
+    std::shared_ptr<TH2D> hist, hist_excl;
+    std::vector<LodLevel> lod_levels;
+    std::vector<ContourLine> contours;
+    std::vector<double> z_list_graph;
+};
 
 struct Arguments : run::ArgumentsBase {
     StrArg input{ "input", "input directory with limit files" };
-    StrArg output{ "output", "output ROOT file with model dependent interpretation" };
+    StrArg output{ "output", "output ROOT file with model dependent interpretation", "" };
     StrArg model{ "model", "physical model", "MSSM" };
-    StrArg model_file{ "model-file", "ROOT file with model description" };
+    StrArg model_file{ "model-file", "ROOT file with model description", "" };
     Arg<size_t> model_file_version{ "model-file-version", "Version of the model file", 1 };
-    Arg<CompositProcess> process{ "process", "process name" };
+    StrArg process{ "process", "process name", "" };
+    StrArg process_def{ "process-def", "additional composite processes in format name=expression separated by ';'."
+                        " Expression is a product of numbers, xs(<process>) and br(<process>), e.g."
+                        " 'ggH_hh=xs(gg->H)*br(H->hh)'", "" };
     Arg<Range<double>> range_x{ "range-x", "x range in format min:max" };
     Arg<Range<double>> range_y{ "range-y", "y range in format min:max" };
     Arg<Units> units{ "units", "units in which limits are given", Units::pb };
+    Arg<RangeWithStep<double>> grid_x{ "grid-x", "x grid of the output histograms in format min:max:step"
+                                       " (required for the model files of version 3)", RangeWithStep<double>() };
+    Arg<RangeWithStep<double>> grid_y{ "grid-y", "y grid of the output histograms in format min:max:step"
+                                       " (required for the model files of version 3)", RangeWithStep<double>() };
+    Arg<size_t> model_chunk_size{ "model-chunk-size", "number of model points that are read at once from the model"
+                                  " files of version 3", 1000000 };
+    Arg<bool> single_precision{ "single-precision", "store model point columns in single precision", false };
+    Arg<InterpolationMethod> interpolation{ "interpolation", "interpolation of the output histograms:"
+                                            " none, delaunay, bilinear or bicubic", InterpolationMethod::None };
+    Arg<SplineMethod> limit_interpolation{ "limit-interpolation", "interpolation of limits as a function of mass:"
+                                           " cspline, akima or pchip", SplineMethod::Cubic };
+    Arg<size_t> upsample{ "upsample", "number of output histogram bins per reference bin along each axis", 1 };
+    StrArg limit_cache{ "limit-cache", "binary index of the limit files: path to the index file, 'auto' to keep it"
+                        " in the input directory (which should be writable) or 'none' to always read all limit"
+                        " files", "none" };
+    Arg<size_t> threads{ "threads", "number of threads (0 - use all available hardware threads)", 1 };
+    StrArg jobs{ "jobs", "file with the list of jobs to run in the batch mode", "" };
+    Arg<size_t> adaptive_levels{ "adaptive-levels", "number of refinement levels of the adaptive scan: limits are"
+                                 " evaluated on every 2^N-th node of the reference grid and only the cells crossed by"
+                                 " the exclusion boundary are refined (0 - evaluate all model points)", 0 };
+    Arg<size_t> lod_levels{ "lod-levels", "number of downsampled levels of the output histograms written into"
+                            " the 'lod' directory of the output file (each level is 2 times coarser)", 0 };
+    Arg<double> watch{ "watch", "watch mode: check the input directories every N seconds and re-run the jobs"
+                       " each time new or updated limit files appear (0 - disabled)", 0 };
+    Arg<double> watch_timeout{ "watch-timeout", "stop the watch mode if the input directories are not changed"
+                               " during N seconds", 3600 };
+    StrArg mH_isolines{ "mH-isolines", "comma separated list of m_H values for which the isolines are extracted", "" };
+};
+
+// Single interpretation: one model, process and units for the limits from one input directory.
+struct InterpretationJob {
+    std::string name, input, model, model_file, output;
+    size_t model_file_version;
+    CompositProcess process;
+    Units units;
+};
+
+using InterpretationJobCollection = std::vector<InterpretationJob>;
+
+// Reads jobs in the config format. Parameters that are not specified are taken from the command line.
+// Example:
+// [ggH_hh_bbtautau_MSSM]
+// model: MSSM
+// model_file: mhmodp.root
+// process: ggH_hh_bbtautau
+// units: fb
+// output: bbtautau_MSSM.root
+class InterpretationJobReader : public analysis::ConfigEntryReader {
+public:
+    InterpretationJobReader(const InterpretationJob& _defaults, bool _has_default_process,
+                            const CompositProcessCatalog& _processes, InterpretationJobCollection& _jobs)
+        : defaults(_defaults), has_default_process(_has_default_process), processes(&_processes), jobs(&_jobs) {}
+
+    virtual void StartEntry(const std::string& name, const std::string& reference_name) override
+    {
+        ConfigEntryReader::StartEntry(name, reference_name);
+        current = defaults;
+        has_process = has_default_process || reference_name.size();
+        if(reference_name.size()) {
+            for(const auto& job : *jobs) {
+                if(job.name == reference_name)
+                    current = job;
+            }
+        }
+        current.name = name;
+        current.output.clear();
+        process.clear();
+        units.clear();
+    }
+
+    virtual void EndEntry() override
+    {
+        CheckReadParamCounts("input", 1, Condition::less_equal);
+        CheckReadParamCounts("model", 1, Condition::less_equal);
+        CheckReadParamCounts("model_file", 1, Condition::less_equal);
+        CheckReadParamCounts("model_file_version", 1, Condition::less_equal);
+        CheckReadParamCounts("process", 1, Condition::less_equal);
+        CheckReadParamCounts("units", 1, Condition::less_equal);
+        CheckReadParamCounts("output", 1, Condition::equal_to);
+
+        if(process.size())
+            current.process = processes->Get(process);
+        else if(!has_process)
+            throw exception("Process for the job '%1%' is not specified.") % current.name;
+        if(units.size())
+            current.units = EnumNameMap<Units>::GetDefault().Parse(units);
+        if(!current.model_file.size())
+            throw exception("Model file for the job '%1%' is not specified.") % current.name;
+        for(const auto& job : *jobs) {
+            if(job.output == current.output)
+                throw exception("Jobs '%1%' and '%2%' have the same output.") % job.name % current.name;
+        }
+        jobs->push_back(current);
+    }
+
+    virtual void ReadParameter(const std::string& /*param_name*/, const std::string& /*param_value*/,
+                               std::istringstream& /*ss*/) override
+    {
+        ParseEntry("input", current.input);
+        ParseEntry("model", current.model);
+        ParseEntry("model_file", current.model_file);
+        ParseEntry("model_file_version", current.model_file_version);
+        ParseEntry("process", process);
+        ParseEntry("units", units);
+        ParseEntry("output", current.output);
+    }
+
+private:
+    InterpretationJob defaults, current;
+    bool has_default_process, has_process;
+    std::string process, units;
+    const CompositProcessCatalog* processes;
+    InterpretationJobCollection* jobs;
 };
 
 class SimpleHHInterpret {
 public:
     using Range = ::analysis::Range<double>;
     using RangeMultiD = ::analysis::RangeMultiD<Range>;
-    using InterpolatorVec = std::vector<InterpolatorPtr>;
+    using LimitInterpolatorVec = std::vector<SplineInterpolator>;
 
     SimpleHHInterpret(const Arguments& _args) : args(_args) {}
 
     void Run()
     {
+        if(!args.upsample())
+            throw exception("Upsample factor should be positive.");
+        if(args.upsample() > 1 && args.interpolation() == InterpolationMethod::None)
+            throw exception("Upsampled output requires interpolation.");
+        const auto jobs = CollectJobs();
+        ThreadPool pool(args.threads());
+        if(pool.GetNumberOfThreads() > 1)
+            EnableRootThreadSafety();
+
+        // Limits and models are loaded once and shared by all jobs that use them.
+        std::map<std::string, LimitTable> limits;
+        std::map<std::string, ModelData> models;
+        for(const auto& job : jobs) {
+            if(!limits.count(job.input) && args.watch() <= 0)
+                limits[job.input] = ReadLimits(job.input, pool, GetLimitCacheFile(args.limit_cache(), job.input));
+            const std::string model_key = GetModelKey(job);
+            if(!models.count(model_key)) {
+                ModelData& model_data = models[model_key];
+                model_data.reader = ModelReaderFactory::Make(job.model_file, job.model_file_version,
+                                                             args.single_precision(), args.grid_x(),
+                                                             args.grid_y());
+                model_data.model = ModelFactory::Make(job.model, model_data.reader);
+                model_data.ref_hist = model_data.reader->GetReferenceHistogram();
+            }
+        }
+
+        if(args.watch() > 0) {
+            Watch(jobs, models, pool);
+            return;
+        }
+        std::mutex root_mutex;
+        pool.ParallelFor(jobs.size(), [&](size_t n) {
+            const InterpretationJob& job = jobs.at(n);
+            RunJob(job, limits.at(job.input), models.at(GetModelKey(job)), pool, root_mutex);
+        });
+    }
+
+private:
+    struct LimitTable {
+        std::vector<double> masses;
+        std::vector<std::vector<double>> values;
+    };
+
+    struct ModelData {
+        std::shared_ptr<ModelReader> reader;
+        std::shared_ptr<Model> model;
+        std::shared_ptr<TH2F> ref_hist;
+    };
+
+    // Selected points of a chunk: z[n] contains r = limit / predicted for the n-th quantile,
+    // while the last element contains the predicted cross section times branching ratio.
+    struct EvaluatedPoints {
+        std::vector<double> x, y, m_H;
+        std::vector<std::vector<double>> z;
+    };
+
+    // Model points that are kept in memory by the watch mode. The index over m_H is built once, so that each update
+    // visits only the points inside of the m_H window of the current limits.
+    struct ModelPoints {
+        EvaluatedPoints points;
+        std::shared_ptr<const KdTree> m_H_index;
+    };
+
+    InterpretationJobCollection CollectJobs() const
+    {
+        InterpretationJob defaults;
+        defaults.name = "main";
+        defaults.input = args.input();
+        defaults.model = args.model();
+        defaults.model_file = args.model_file();
+        defaults.model_file_version = args.model_file_version();
+        const CompositProcessCatalog processes(args.process_def());
+        defaults.process = processes.Get("ggH_hh_bbtautau");
+        if(args.process().size())
+            defaults.process = processes.Get(args.process());
+        defaults.units = args.units();
+        defaults.output = args.output();
+
+        InterpretationJobCollection jobs;
+        if(args.jobs().size()) {
+            analysis::ConfigReader config_reader;
+            InterpretationJobReader job_reader(defaults, args.process().size(), processes, jobs);
+            config_reader.AddEntryReader("JOB", job_reader, true);
+            config_reader.ReadConfig(args.jobs());
+            if(jobs.empty())
+                throw exception("No jobs are defined in '%1%'.") % args.jobs();
+        } else {
+            if(!args.output().size() || !args.model_file().size() || !args.process().size())
+                throw exception("Output, model file and process should be specified if the jobs file is not set.");
+            jobs.push_back(defaults);
+        }
+        return jobs;
+    }
+
+    static std::string GetModelKey(const InterpretationJob& job)
+    {
+        std::ostringstream ss;
+        ss << job.model << ":" << job.model_file_version << ":" << job.model_file;
+        return ss.str();
+    }
+
+    // Signature of the input directory: names, sizes and modification times (in nanoseconds) of the limit files.
+    using InputSignature = std::vector<std::tuple<std::string, uint64_t, int64_t>>;
+
+    static InputSignature GetInputSignature(const std::string& input_dir_name)
+    {
+        InputSignature signature;
+        for(const auto& file : GetOrderedFileList(input_dir_name, LimitFilePattern())) {
+            uint64_t size;
+            int64_t mtime;
+            if(!GetFileStatus(file.file_name, size, mtime)) continue;
+            signature.emplace_back(file.file_name, size, mtime);
+        }
+        return signature;
+    }
+
+    // Jobs are re-run each time the limit files in their input directory are changed. Limits of the files that
+    // are not changed are taken from the limit index, while the selected model points are kept in memory, so that
+    // each update requires only reading of the new limit files and the evaluation of the limits.
+    // Errors caused by the incomplete input (e.g. a limit file that is still being written) are reported and
+    // the update is retried on the next check.
+    void Watch(const InterpretationJobCollection& jobs, const std::map<std::string, ModelData>& models,
+               ThreadPool& pool) const
+    {
+        using Clock = std::chrono::steady_clock;
         const RangeMultiD param_range({ args.range_x(), args.range_y() });
-        Range m_H_range;
-        const auto& limits = ReadInterpolatedLimits(args.input(), m_H_range, args.units());
-        const auto model_reader = ModelReaderFactory::Make(args.model_file(), args.model_file_version());
-        const auto model = ModelFactory::Make(args.model(), model_reader);
-        std::vector<double> x_list, y_list, z_list_pred;
-        std::vector<std::vector<double>> z_list(limits.size());
-
-        for(const auto& desc : model->GetAvailablePoints()) {
-            if(!param_range.Contains(desc.point)) continue;
-            const double th_predicted = std::max(desc.GetProcessBR_CS(args.process()), 0.0);
-            const double m_H = desc.GetMass(Particle::H);
-            if(!m_H_range.Contains(m_H) || !th_predicted) continue;
-            x_list.push_back(desc.point.at(0));
-            y_list.push_back(desc.point.at(1));
-            z_list_pred.push_back(th_predicted);
-            for(size_t n = 0; n < limits.size(); ++n) {
-                const double r = limits.at(n)->Eval(m_H) / th_predicted;
-                z_list.at(n).push_back(r);
+        std::map<std::string, InputSignature> signatures;
+        std::map<std::string, LimitTable> limits;
+        std::vector<std::shared_ptr<ModelPoints>> model_points(jobs.size());
+        std::mutex root_mutex, output_mutex;
+        auto last_change = Clock::now();
+
+        std::cout << "Watching " << jobs.size() << " job(s) for new limit files." << std::endl;
+        while(true) {
+            std::set<std::string> updated_inputs;
+            for(const auto& job : jobs) {
+                if(updated_inputs.count(job.input)) continue;
+                const InputSignature signature = GetInputSignature(job.input);
+                if(signatures.count(job.input) && signatures.at(job.input) == signature) continue;
+                try {
+                    limits[job.input] = ReadLimits(job.input, pool, GetLimitCacheFile(args.limit_cache(), job.input));
+                    signatures[job.input] = signature;
+                    updated_inputs.insert(job.input);
+                } catch(std::exception& e) {
+                    std::cerr << "WARNING: limits from '" << job.input << "' are not updated: " << e.what()
+                              << std::endl;
+                }
+            }
+
+            if(updated_inputs.size()) {
+                last_change = Clock::now();
+                pool.ParallelFor(jobs.size(), [&](size_t n) {
+                    const InterpretationJob& job = jobs.at(n);
+                    if(!updated_inputs.count(job.input)) return;
+                    try {
+                        const ModelData& model_data = models.at(GetModelKey(job));
+                        if(!model_points.at(n)) {
+                            auto points = std::make_shared<ModelPoints>();
+                            ReadModelPoints(job, *model_data.model, param_range, points->points);
+                            points->m_H_index = std::make_shared<KdTree>(
+                                    std::vector<std::vector<double>>{ points->points.m_H });
+                            model_points.at(n) = points;
+                        }
+                        RunJob(job, limits.at(job.input), model_data, pool, root_mutex, model_points.at(n).get());
+                    } catch(std::exception& e) {
+                        std::lock_guard<std::mutex> lock(output_mutex);
+                        std::cerr << "WARNING: job '" << job.name << "' is not updated: " << e.what() << std::endl;
+                    }
+                });
+            } else if(Clock::now() - last_change > std::chrono::duration<double>(args.watch_timeout())) {
+                std::cout << "No changes in the input directories during " << args.watch_timeout()
+                          << " seconds. Watch mode is finished." << std::endl;
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::duration<double>(args.watch()));
+        }
+    }
+
+    // If model points are provided, they are used instead of reading the model.
+    void RunJob(const InterpretationJob& job, const LimitTable& raw_limits, const ModelData& model_data,
+                ThreadPool& pool, std::mutex& root_mutex, const ModelPoints* model_points = nullptr) const
+    {
+        const RangeMultiD param_range({ args.range_x(), args.range_y() });
+        const double units_factor = GetUnitsFactor(job.units);
+        LimitTable limits = raw_limits;
+        for(auto& quantile_limits : limits.values) {
+            for(double& limit : quantile_limits)
+                limit *= units_factor;
+        }
+        const Range m_H_range(limits.masses.front(), limits.masses.back());
+        const auto interps = CreateLimitInterpolators(limits, args.limit_interpolation());
+        const auto& ref_hist = model_data.ref_hist;
+
+        EvaluatedPoints evaluated;
+        if(args.adaptive_levels()) {
+            EvaluatedPoints read_model_points;
+            const EvaluatedPoints* points = model_points ? &model_points->points : nullptr;
+            if(!points) {
+                ReadModelPoints(job, *model_data.model, param_range, read_model_points);
+                points = &read_model_points;
+            }
+            ScanAdaptive(*points, *ref_hist, interps, m_H_range, pool, evaluated);
+        } else if(model_points) {
+            EvaluateModelPoints(*model_points, interps, m_H_range, pool, evaluated);
+        } else {
+            ScanAllPoints(job, *model_data.model, interps, param_range, m_H_range, pool, evaluated);
+        }
+        const std::vector<double>& x_list = evaluated.x, &y_list = evaluated.y, &m_H_list = evaluated.m_H;
+        const std::vector<std::vector<double>>& z_list = evaluated.z;
+
+        std::vector<OutputDescriptor> descriptors;
+        for(size_t n = 0; n < limits.values.size(); ++n)
+            descriptors.push_back(OutputDescriptor(all_limit_quantile_names.at(n), 1.0, 0.05, 1.0));
+        descriptors.push_back(OutputDescriptor("predicted_CS_BR"));
+
+        const auto interpolator = CreateOutputInterpolator(args.interpolation(), x_list, y_list, *ref_hist,
+                                                           args.upsample());
+        std::vector<std::shared_ptr<Output>> outputs;
+        {
+            std::lock_guard<std::mutex> lock(root_mutex);
+            for(const auto& desc : descriptors)
+                outputs.push_back(std::make_shared<Output>(desc, ref_hist, args.upsample(), args.lod_levels()));
+        }
+        pool.ParallelFor(outputs.size(), [&](size_t n) {
+            outputs.at(n)->Fill(x_list, y_list, z_list.at(n), interpolator.get());
+        });
+
+        const auto mH_isoline_values = GetIsolineValues();
+        std::vector<std::vector<ContourLine>> mH_isolines(mH_isoline_values.size());
+        if(mH_isoline_values.size()) {
+            const auto m_H_bins = ComputeBinValues(*ref_hist, x_list, y_list, m_H_list, interpolator.get());
+            pool.ParallelFor(mH_isoline_values.size(), [&](size_t n) {
+                mH_isolines.at(n) = ExtractContours(*ref_hist, args.upsample(), m_H_bins, mH_isoline_values.at(n));
+            });
+        }
+
+        // The output is written into a temporary file which then replaces the original one, so that the output
+        // file is always complete, even when it is read during the watch mode.
+        std::lock_guard<std::mutex> lock(root_mutex);
+        const std::string tmp_output = job.output + ".tmp";
+        {
+            auto output_file = root_ext::CreateRootFile(tmp_output);
+            for(const auto& output : outputs)
+                output->Write(x_list, y_list, output_file);
+            for(size_t n = 0; n < mH_isoline_values.size(); ++n) {
+                std::ostringstream ss_prefix;
+                ss_prefix << "mH_" << mH_isoline_values.at(n) << "_isoline";
+                WriteContours(ss_prefix.str(), mH_isolines.at(n), *output_file);
             }
         }
+        outputs.clear();
+        if(std::rename(tmp_output.c_str(), job.output.c_str()))
+            throw exception("Unable to move '%1%' to '%2%'.") % tmp_output % job.output;
+        std::cout << "File '" << job.output << "' successfully created.\n";
+    }
 
-        const auto ref_hist = model_reader->GetReferenceHistogram();
-        auto output_file = root_ext::CreateRootFile(args.output());
-        for(size_t n = 0; n < limits.size(); ++n)
-            CreateOutput(x_list, y_list, z_list.at(n), output_file, all_limit_quantile_names.at(n), ref_hist,
-                         1.0, 0.05, 1.0);
-        CreateOutput(x_list, y_list, z_list_pred, output_file, "predicted_CS_BR", ref_hist);
+    std::vector<double> GetIsolineValues() const
+    {
+        std::vector<double> values;
+        if(!args.mH_isolines().size()) return values;
+        for(const auto& value_str : SplitValueList(args.mH_isolines(), false, ",", true))
+            values.push_back(Parse<double>(value_str));
+        return values;
+    }
 
-        std::cout << "File '" << args.output() << "' successfully created.\n";
+    void ScanAllPoints(const InterpretationJob& job, const Model& model, const LimitInterpolatorVec& interps,
+                       const RangeMultiD& param_range, const Range& m_H_range, ThreadPool& pool,
+                       EvaluatedPoints& result) const
+    {
+        // Each chunk provided by the model reader is split into blocks of a fixed size, independent of the number
+        // of threads. Each block is evaluated into its own buffer and the buffers are concatenated in the block
+        // order, so the result is identical to the serial evaluation. Only the selected points are kept.
+        const size_t block_size = 16384;
+        std::vector<EvaluatedPoints> chunks;
+        model.ReadPoints(args.model_chunk_size(), param_range, [&](const Model::PointCollection& points) {
+            std::vector<double> th_predicted_column;
+            points.ComputeProcessBR_CS(job.process, th_predicted_column);
+            const size_t n_blocks = (points.size() + block_size - 1) / block_size;
+            const size_t offset = chunks.size();
+            chunks.resize(offset + n_blocks);
+            pool.ParallelFor(n_blocks, [&](size_t block_id) {
+                const size_t begin = block_id * block_size;
+                const size_t end = std::min(begin + block_size, points.size());
+                EvaluatePoints(points, th_predicted_column, interps, param_range, m_H_range, begin, end,
+                               chunks.at(offset + block_id));
+            });
+        });
+
+        result.z.resize(interps.size() + 1);
+        for(const auto& chunk : chunks) {
+            result.x.insert(result.x.end(), chunk.x.begin(), chunk.x.end());
+            result.y.insert(result.y.end(), chunk.y.begin(), chunk.y.end());
+            result.m_H.insert(result.m_H.end(), chunk.m_H.begin(), chunk.m_H.end());
+            for(size_t n = 0; n < result.z.size(); ++n)
+                result.z.at(n).insert(result.z.at(n).end(), chunk.z.at(n).begin(), chunk.z.at(n).end());
+        }
     }
 
-private:
-    InterpolatorVec ReadInterpolatedLimits(const std::string& input_dir_name, Range& mass_range, Units units)
+    // Model points inside of the parameter range with a positive predicted cross section times branching ratio,
+    // which is stored as the only element of z. The selection by m_H is not applied.
+    void ReadModelPoints(const InterpretationJob& job, const Model& model, const RangeMultiD& param_range,
+                         EvaluatedPoints& model_points) const
     {
-        const auto& file_names = GetOrderedFileList(input_dir_name, ".*\\.root");
-        std::vector<std::vector<double>> limits(all_limit_quantiles.size());
-        std::set<double> masses;
-        const double units_factor = GetUnitsFactor(units);
+        model_points.z.resize(1);
+        model.ReadPoints(args.model_chunk_size(), param_range, [&](const Model::PointCollection& points) {
+            std::vector<double> th_predicted_column;
+            points.ComputeProcessBR_CS(job.process, th_predicted_column);
+            const PointColumn& m_H_column = points.GetMasses(Particle::H);
+            Model::Point point;
+            for(size_t point_id = 0; point_id < points.size(); ++point_id) {
+                points.GetPoint(point_id, point);
+                const double th_predicted = std::max(th_predicted_column[point_id], 0.0);
+                if(!param_range.Contains(point) || !th_predicted) continue;
+                model_points.x.push_back(point.at(0));
+                model_points.y.push_back(point.at(1));
+                model_points.m_H.push_back(m_H_column.at(point_id));
+                model_points.z.front().push_back(th_predicted);
+            }
+        });
+    }
 
-        if(!file_names.size())
-            throw exception("No input files are found.");
+    // Same selection and evaluation as in ScanAllPoints for the model points that are already in memory.
+    // The points inside of the m_H window are found using the index, in the original order of the points.
+    static void EvaluateModelPoints(const ModelPoints& model_points, const LimitInterpolatorVec& interps,
+                                    const Range& m_H_range, ThreadPool& pool, EvaluatedPoints& result)
+    {
+        const size_t block_size = 16384;
+        const EvaluatedPoints& points = model_points.points;
+        const auto selected = model_points.m_H_index->FindInBox({ m_H_range.min() }, { m_H_range.max() });
+        const size_t n_blocks = (selected.size() + block_size - 1) / block_size;
+        std::vector<EvaluatedPoints> blocks(n_blocks);
+        pool.ParallelFor(n_blocks, [&](size_t block_id) {
+            const size_t begin = block_id * block_size;
+            const size_t end = std::min(begin + block_size, selected.size());
+            EvaluatedPoints& block = blocks.at(block_id);
+            std::vector<double> th_predicted_list;
+            for(size_t k = begin; k < end; ++k) {
+                const size_t n = selected[k];
+                block.x.push_back(points.x[n]);
+                block.y.push_back(points.y[n]);
+                block.m_H.push_back(points.m_H[n]);
+                th_predicted_list.push_back(points.z.front()[n]);
+            }
+            EvaluateLimits(interps, th_predicted_list, block);
+        });
+
+        result.z.resize(interps.size() + 1);
+        for(const auto& block : blocks) {
+            result.x.insert(result.x.end(), block.x.begin(), block.x.end());
+            result.y.insert(result.y.end(), block.y.begin(), block.y.end());
+            result.m_H.insert(result.m_H.end(), block.m_H.begin(), block.m_H.end());
+            for(size_t n = 0; n < result.z.size(); ++n)
+                result.z.at(n).insert(result.z.at(n).end(), block.z.at(n).begin(), block.z.at(n).end());
+        }
+    }
 
-        for(const auto& file_entry : file_names) {
-            const std::string& file_name = file_entry.second;
-            const double mass = file_entry.first;
-            std::cout << "Reading " << file_name << std::endl;
-            if(masses.count(mass))
-                throw exception("More than one file with for the mass point = %1%") % mass;
-
-            masses.insert(mass);
-            std::shared_ptr<TFile> file(new TFile(file_name.c_str(), "READ"));
-            std::shared_ptr<TTree> tree(dynamic_cast<TTree*>(file->Get("limit")));
-            double limit;
-            float quantileExpected;
-            tree->SetBranchAddress("limit", &limit);
-            tree->SetBranchAddress("quantileExpected", &quantileExpected);
-            for(Long64_t n = 0; n < tree->GetEntries(); ++n) {
-                tree->GetEntry(n);
-                const size_t quantile_id = GetQuantileId(quantileExpected);
-                limits.at(quantile_id).push_back(limit * units_factor);
+    // Limits are evaluated only on the nodes of the reference grid requested by the adaptive scan, the remaining
+    // nodes are interpolated. Each node takes the model point closest to its center among the points inside of
+    // the node bin that pass the m_H window, so the model points don't have to lie exactly on the grid.
+    // The predicted cross section times branching ratio is taken from the model point for all nodes. Nodes that have
+    // a model point are active for the scan, so they are always evaluated or interpolated from evaluated nodes.
+    void ScanAdaptive(const EvaluatedPoints& model_points, const TH2F& ref_hist, const LimitInterpolatorVec& interps,
+                      const Range& m_H_range, ThreadPool& pool, EvaluatedPoints& result) const
+    {
+        const TAxis& x_axis = *ref_hist.GetXaxis(), &y_axis = *ref_hist.GetYaxis();
+        const size_t n_x = static_cast<size_t>(x_axis.GetNbins()), n_y = static_cast<size_t>(y_axis.GetNbins());
+        const auto x_edges = GetBinEdges(x_axis), y_edges = GetBinEdges(y_axis);
+        const auto x_centers = GetBinCenters(x_edges), y_centers = GetBinCenters(y_edges);
+
+        const double x_scale = 1. / (x_edges.back() - x_edges.front());
+        const double y_scale = 1. / (y_edges.back() - y_edges.front());
+        const KdTree index({ model_points.x, model_points.y, model_points.m_H }, { x_scale, y_scale, 0. });
+        std::vector<double> node_m_H(n_x * n_y, AdaptiveGridScan::NaN()), node_th_predicted(n_x * n_y, 0.);
+        pool.ParallelFor(n_x, [&](size_t x_id) {
+            for(size_t y_id = 0; y_id < n_y; ++y_id) {
+                const KdTree::Point box_min = { x_edges.at(x_id), y_edges.at(y_id), m_H_range.min() };
+                const KdTree::Point box_max = { x_edges.at(x_id + 1), y_edges.at(y_id + 1), m_H_range.max() };
+                const auto candidates = index.FindInBox(box_min, box_max);
+                double best_distance = std::numeric_limits<double>::infinity();
+                for(size_t point_id : candidates) {
+                    const double dx = (model_points.x[point_id] - x_centers[x_id]) * x_scale;
+                    const double dy = (model_points.y[point_id] - y_centers[y_id]) * y_scale;
+                    const double distance = dx * dx + dy * dy;
+                    if(distance >= best_distance) continue;
+                    best_distance = distance;
+                    node_m_H[x_id * n_y + y_id] = model_points.m_H[point_id];
+                    node_th_predicted[x_id * n_y + y_id] = model_points.z.front()[point_id];
+                }
             }
+        });
+
+        const size_t block_size = 16384;
+        AdaptiveGridScan scan(n_x, n_y, std::vector<double>(interps.size(), 1.0), args.adaptive_levels());
+        std::vector<bool> active_nodes(n_x * n_y);
+        for(size_t index = 0; index < active_nodes.size(); ++index)
+            active_nodes[index] = node_th_predicted[index] > 0;
+        const auto evaluator = [&](const std::vector<size_t>& nodes, std::vector<std::vector<double>>& r) {
+            const size_t n_blocks = (nodes.size() + block_size - 1) / block_size;
+            pool.ParallelFor(n_blocks, [&](size_t block_id) {
+                const size_t begin = block_id * block_size;
+                const size_t end = std::min(begin + block_size, nodes.size());
+                std::vector<double> m_H_list;
+                for(size_t k = begin; k < end; ++k)
+                    m_H_list.push_back(node_m_H[nodes[k]]);
+                std::vector<size_t> segments(m_H_list.size());
+                std::vector<double> dx(m_H_list.size()), limits(m_H_list.size());
+                interps.front().Locate(m_H_list.data(), m_H_list.size(), segments.data(), dx.data());
+                for(size_t n = 0; n < interps.size(); ++n) {
+                    interps.at(n).Eval(segments.data(), dx.data(), limits.size(), limits.data());
+                    for(size_t k = begin; k < end; ++k)
+                        r.at(n)[k] = limits[k - begin] / node_th_predicted[nodes[k]];
+                }
+            });
+        };
+        const auto r_values = scan.Run(evaluator, active_nodes);
+
+        result.z.resize(interps.size() + 1);
+        for(size_t x_id = 0; x_id < n_x; ++x_id) {
+            for(size_t y_id = 0; y_id < n_y; ++y_id) {
+                const size_t index = x_id * n_y + y_id;
+                if(!node_th_predicted[index]) continue;
+                result.x.push_back(x_centers.at(x_id));
+                result.y.push_back(y_centers.at(y_id));
+                result.m_H.push_back(node_m_H[index]);
+                for(size_t n = 0; n < interps.size(); ++n)
+                    result.z.at(n).push_back(r_values.at(n)[index]);
+                result.z.back().push_back(node_th_predicted[index]);
+            }
+        }
+        std::cout << "Adaptive scan: limits are evaluated for " << scan.GetNumberOfEvaluatedNodes() << " of "
+                  << n_x * n_y << " grid nodes." << std::endl;
+    }
+
+    static LimitInterpolatorVec CreateLimitInterpolators(const LimitTable& limits, SplineMethod method)
+    {
+        LimitInterpolatorVec interps;
+        for(const auto& quantile_limits : limits.values)
+            interps.push_back(SplineInterpolator(limits.masses, quantile_limits, method));
+        return interps;
+    }
+
+    // Points are selected first. Then the mass segments are found once for all selected points and reused by
+    // the interpolators of all quantiles, which are defined on the same mass nodes.
+    static void EvaluatePoints(const Model::PointCollection& points, const std::vector<double>& th_predicted_column,
+                               const LimitInterpolatorVec& interps, const RangeMultiD& param_range,
+                               const Range& m_H_range, size_t begin, size_t end, EvaluatedPoints& result)
+    {
+        const PointColumn& m_H_column = points.GetMasses(Particle::H);
+        std::vector<double> th_predicted_list;
+        Model::Point point;
+        for(size_t point_id = begin; point_id < end; ++point_id) {
+            points.GetPoint(point_id, point);
+            if(!param_range.Contains(point)) continue;
+            const double th_predicted = std::max(th_predicted_column[point_id], 0.0);
+            const double m_H = m_H_column.at(point_id);
+            if(!m_H_range.Contains(m_H) || !th_predicted) continue;
+            result.x.push_back(point.at(0));
+            result.y.push_back(point.at(1));
+            result.m_H.push_back(m_H);
+            th_predicted_list.push_back(th_predicted);
+        }
+        EvaluateLimits(interps, th_predicted_list, result);
+    }
+
+    // Fills z of the selected points, which have x, y and m_H already set.
+    static void EvaluateLimits(const LimitInterpolatorVec& interps, const std::vector<double>& th_predicted_list,
+                               EvaluatedPoints& result)
+    {
+        const size_t n_selected = result.m_H.size();
+        std::vector<size_t> segments(n_selected);
+        std::vector<double> dx(n_selected);
+        if(interps.size())
+            interps.front().Locate(result.m_H.data(), n_selected, segments.data(), dx.data());
+        result.z.resize(interps.size() + 1);
+        for(size_t n = 0; n < interps.size(); ++n) {
+            std::vector<double>& r = result.z.at(n);
+            r.resize(n_selected);
+            interps.at(n).Eval(segments.data(), dx.data(), n_selected, r.data());
+            for(size_t k = 0; k < n_selected; ++k)
+                r[k] /= th_predicted_list[k];
+        }
+        result.z.back() = th_predicted_list;
+    }
+
+    static const std::string& LimitFilePattern() { static const std::string pattern = ".*\\.root"; return pattern; }
+
+    static std::string GetLimitCacheFile(const std::string& limit_cache, const std::string& input_dir_name)
+    {
+        if(limit_cache == "none") return "";
+        if(limit_cache == "auto") return input_dir_name + "/.limit_index";
+        return limit_cache;
+    }
+
+    // Limits are stored in the units of the input files.
+    static LimitTable ReadLimits(const std::string& input_dir_name, ThreadPool& pool, const std::string& cache_file)
+    {
+        const LimitFileList files = GetOrderedFileList(input_dir_name, LimitFilePattern());
+        if(!files.size())
+            throw exception("No input files are found.");
+        for(size_t n = 1; n < files.size(); ++n) {
+            if(files.at(n).mass == files.at(n - 1).mass)
+                throw exception("More than one file with for the mass point = %1%") % files.at(n).mass;
         }
 
-        const std::vector<double> mass_vec(masses.begin(), masses.end());
-        mass_range = Range(mass_vec.front(), mass_vec.back());
-        InterpolatorVec interps;
-        for(size_t n = 0; n < limits.size(); ++n) {
-            if(limits[n].size() != masses.size())
+        size_t n_cached = 0;
+        const auto file_limits = ReadLimitFiles(files, pool, cache_file, &n_cached);
+        LimitTable table;
+        table.values.resize(all_limit_quantiles.size());
+        for(size_t file_id = 0; file_id < files.size(); ++file_id) {
+            table.masses.push_back(files.at(file_id).mass);
+            for(size_t n = 0; n < table.values.size(); ++n) {
+                for(double limit : file_limits.at(file_id).at(n))
+                    table.values[n].push_back(limit);
+            }
+        }
+        for(size_t n = 0; n < table.values.size(); ++n) {
+            if(table.values[n].size() != table.masses.size())
                 throw exception("Inconsistent input limits.");
-            InterpolatorPtr interp(new ROOT::Math::Interpolator(mass_vec, limits[n], ROOT::Math::Interpolation::kCSPLINE));
-            interps.push_back(interp);
         }
-        return interps;
+        const Range mass_range(table.masses.front(), table.masses.back());
+        std::cout << "Limits for " << files.size() << " mass points in range " << mass_range
+                  << " are read from '" << input_dir_name << "' (" << n_cached << " taken from the index)."
+                  << std::endl;
+        return table;
     }
 
 private:
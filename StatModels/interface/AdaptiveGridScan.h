@@ -0,0 +1,239 @@
+/*! Definition of the adaptive evaluation of functions on a regular grid around their threshold crossings.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include "HHStatAnalysis/Core/interface/exception.h"
+
+namespace hh_analysis {
+
+// Functions are first evaluated on a coarse subset of the grid nodes with a step 2^n_levels. Cells whose corners
+// are on different sides of the threshold for at least one function, or that are partially undefined, are split
+// in four and the new corners are evaluated. The splitting continues until the cells consist of adjacent nodes.
+// Nodes of the cells that were not refined are bilinearly interpolated from the cell corners. Cells for which
+// all corners are undefined are considered outside of the scan region and their nodes are left undefined (NaN),
+// unless they contain an active node. Active nodes (e.g. nodes that have a model point) mark the scan region
+// explicitly: cells that contain an active node and have an undefined corner are always refined, and active nodes
+// that are still undefined after the interpolation are evaluated directly, so they are never left undefined
+// because of the sparse coarse grid.
+// Node values are stored in x-major order (index = x_id * n_y + y_id).
+class AdaptiveGridScan {
+public:
+    using ValueList = std::vector<double>;
+    // Should fill values[f][k] with the value of the function f on the node node_ids[k].
+    using Evaluator = std::function<void(const std::vector<size_t>& node_ids, std::vector<ValueList>& values)>;
+
+    static constexpr double NaN() { return std::numeric_limits<double>::quiet_NaN(); }
+
+    AdaptiveGridScan(size_t _n_x, size_t _n_y, const std::vector<double>& _thresholds, size_t _n_levels)
+        : n_x(_n_x), n_y(_n_y), thresholds(_thresholds), n_levels(_n_levels), n_evaluated(0)
+    {
+        if(!n_x || !n_y)
+            throw analysis::exception("Grid for the adaptive scan is empty.");
+        if(thresholds.empty())
+            throw analysis::exception("No functions are defined for the adaptive scan.");
+        if(n_levels >= 8 * sizeof(size_t))
+            throw analysis::exception("Too many refinement levels = %1%.") % n_levels;
+    }
+
+    size_t GetNumberOfEvaluatedNodes() const { return n_evaluated; }
+
+    // active_nodes should be either empty or contain a flag for each node.
+    std::vector<ValueList> Run(const Evaluator& evaluator, const std::vector<bool>& active_nodes = {})
+    {
+        if(!active_nodes.empty() && active_nodes.size() != n_x * n_y)
+            throw analysis::exception("Inconsistent number of active nodes for the adaptive scan.");
+        values.assign(thresholds.size(), ValueList(n_x * n_y, NaN()));
+        requested.assign(n_x * n_y, false);
+        n_evaluated = 0;
+        CountActiveNodes(active_nodes);
+
+        const auto x_lines = GetCoarseLines(n_x), y_lines = GetCoarseLines(n_y);
+        std::vector<size_t> nodes;
+        for(size_t x_id : x_lines) {
+            for(size_t y_id : y_lines)
+                Request(x_id, y_id, nodes);
+        }
+        Evaluate(nodes, evaluator);
+
+        std::vector<Cell> cells, leaves;
+        for(size_t i = 0; i + 1 < x_lines.size(); ++i) {
+            for(size_t j = 0; j + 1 < y_lines.size(); ++j)
+                cells.push_back(Cell{ x_lines[i], x_lines[i + 1], y_lines[j], y_lines[j + 1] });
+        }
+        while(!cells.empty()) {
+            std::vector<Cell> next_cells;
+            nodes.clear();
+            for(const Cell& cell : cells) {
+                if(!IsSplittable(cell) || !NeedsRefinement(cell)) {
+                    leaves.push_back(cell);
+                    continue;
+                }
+                const size_t x_mid = (cell.x_min + cell.x_max) / 2, y_mid = (cell.y_min + cell.y_max) / 2;
+                const size_t x_bounds[] = { cell.x_min, x_mid, cell.x_max };
+                const size_t y_bounds[] = { cell.y_min, y_mid, cell.y_max };
+                for(size_t i = 0; i < 2; ++i) {
+                    if(x_bounds[i] == x_bounds[i + 1]) continue;
+                    for(size_t j = 0; j < 2; ++j) {
+                        if(y_bounds[j] == y_bounds[j + 1]) continue;
+                        const Cell sub_cell{ x_bounds[i], x_bounds[i + 1], y_bounds[j], y_bounds[j + 1] };
+                        for(size_t x_id : { sub_cell.x_min, sub_cell.x_max }) {
+                            for(size_t y_id : { sub_cell.y_min, sub_cell.y_max })
+                                Request(x_id, y_id, nodes);
+                        }
+                        next_cells.push_back(sub_cell);
+                    }
+                }
+            }
+            Evaluate(nodes, evaluator);
+            cells.swap(next_cells);
+        }
+
+        // Nodes on the border between a coarse and a refined cell are taken from the refined cell.
+        std::stable_sort(leaves.begin(), leaves.end(), [](const Cell& a, const Cell& b) {
+            return a.Area() < b.Area();
+        });
+        std::vector<bool> filled(requested);
+        for(const Cell& cell : leaves)
+            FillCell(cell, filled);
+
+        nodes.clear();
+        for(size_t index = 0; index < active_nodes.size(); ++index) {
+            if(!active_nodes[index] || requested[index]) continue;
+            for(const ValueList& function_values : values) {
+                if(!std::isnan(function_values[index])) continue;
+                requested[index] = true;
+                nodes.push_back(index);
+                break;
+            }
+        }
+        Evaluate(nodes, evaluator);
+        return std::move(values);
+    }
+
+private:
+    struct Cell {
+        size_t x_min, x_max, y_min, y_max;
+        size_t Area() const { return (x_max - x_min) * (y_max - y_min); }
+    };
+
+    size_t Index(size_t x_id, size_t y_id) const { return x_id * n_y + y_id; }
+
+    // Prefix sums over the grid: active_counts[x * (n_y + 1) + y] is the number of active nodes with x_id < x and
+    // y_id < y.
+    void CountActiveNodes(const std::vector<bool>& active_nodes)
+    {
+        active_counts.clear();
+        if(active_nodes.empty()) return;
+        active_counts.assign((n_x + 1) * (n_y + 1), 0);
+        for(size_t x_id = 0; x_id < n_x; ++x_id) {
+            for(size_t y_id = 0; y_id < n_y; ++y_id) {
+                active_counts[(x_id + 1) * (n_y + 1) + y_id + 1] = active_counts[x_id * (n_y + 1) + y_id + 1]
+                        + active_counts[(x_id + 1) * (n_y + 1) + y_id] - active_counts[x_id * (n_y + 1) + y_id]
+                        + (active_nodes[Index(x_id, y_id)] ? 1 : 0);
+            }
+        }
+    }
+
+    bool HasActiveNodes(const Cell& cell) const
+    {
+        if(active_counts.empty()) return false;
+        const size_t x_min = cell.x_min, x_max = cell.x_max + 1, y_min = cell.y_min, y_max = cell.y_max + 1;
+        return active_counts[x_max * (n_y + 1) + y_max] + active_counts[x_min * (n_y + 1) + y_min]
+                > active_counts[x_min * (n_y + 1) + y_max] + active_counts[x_max * (n_y + 1) + y_min];
+    }
+
+    std::vector<size_t> GetCoarseLines(size_t n_nodes) const
+    {
+        const size_t step = size_t(1) << n_levels;
+        std::vector<size_t> lines;
+        for(size_t n = 0; n < n_nodes; n += step)
+            lines.push_back(n);
+        if(lines.back() != n_nodes - 1)
+            lines.push_back(n_nodes - 1);
+        return lines;
+    }
+
+    void Request(size_t x_id, size_t y_id, std::vector<size_t>& nodes)
+    {
+        const size_t index = Index(x_id, y_id);
+        if(requested[index]) return;
+        requested[index] = true;
+        nodes.push_back(index);
+    }
+
+    void Evaluate(const std::vector<size_t>& nodes, const Evaluator& evaluator)
+    {
+        if(nodes.empty()) return;
+        std::vector<ValueList> node_values(thresholds.size(), ValueList(nodes.size(), NaN()));
+        evaluator(nodes, node_values);
+        for(size_t f = 0; f < thresholds.size(); ++f) {
+            if(node_values.at(f).size() != nodes.size())
+                throw analysis::exception("Inconsistent number of evaluated values.");
+            for(size_t k = 0; k < nodes.size(); ++k)
+                values[f][nodes[k]] = node_values[f][k];
+        }
+        n_evaluated += nodes.size();
+    }
+
+    static bool IsSplittable(const Cell& cell)
+    {
+        return cell.x_max - cell.x_min > 1 || cell.y_max - cell.y_min > 1;
+    }
+
+    bool NeedsRefinement(const Cell& cell) const
+    {
+        const size_t corners[] = { Index(cell.x_min, cell.y_min), Index(cell.x_max, cell.y_min),
+                                   Index(cell.x_min, cell.y_max), Index(cell.x_max, cell.y_max) };
+        const bool has_active_nodes = HasActiveNodes(cell);
+        for(size_t f = 0; f < thresholds.size(); ++f) {
+            size_t n_nan = 0, n_above = 0;
+            for(size_t corner : corners) {
+                const double value = values[f][corner];
+                if(std::isnan(value))
+                    ++n_nan;
+                else if(value >= thresholds[f])
+                    ++n_above;
+            }
+            if(n_nan == 4 && !has_active_nodes) continue;
+            if(n_nan || (n_above && n_above < 4)) return true;
+        }
+        return false;
+    }
+
+    void FillCell(const Cell& cell, std::vector<bool>& filled)
+    {
+        const double x_size = cell.x_max - cell.x_min, y_size = cell.y_max - cell.y_min;
+        for(size_t x_id = cell.x_min; x_id <= cell.x_max; ++x_id) {
+            const double tx = x_size ? (x_id - cell.x_min) / x_size : 0.;
+            for(size_t y_id = cell.y_min; y_id <= cell.y_max; ++y_id) {
+                const size_t index = Index(x_id, y_id);
+                if(filled[index]) continue;
+                filled[index] = true;
+                const double ty = y_size ? (y_id - cell.y_min) / y_size : 0.;
+                for(size_t f = 0; f < thresholds.size(); ++f) {
+                    const ValueList& v = values[f];
+                    values[f][index] = (1 - tx) * (1 - ty) * v[Index(cell.x_min, cell.y_min)]
+                            + tx * (1 - ty) * v[Index(cell.x_max, cell.y_min)]
+                            + (1 - tx) * ty * v[Index(cell.x_min, cell.y_max)]
+                            + tx * ty * v[Index(cell.x_max, cell.y_max)];
+                }
+            }
+        }
+    }
+
+private:
+    size_t n_x, n_y;
+    std::vector<double> thresholds;
+    size_t n_levels, n_evaluated;
+    std::vector<ValueList> values;
+    std::vector<bool> requested;
+    std::vector<size_t> active_counts;
+};
+
+} // namespace hh_analysis
@@ -0,0 +1,317 @@
+/*! Definition of tools to read limits produced by combine.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <mutex>
+#include <fstream>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdio>
+#include <sys/stat.h>
+#include <boost/regex.hpp>
+#include <boost/filesystem.hpp>
+#include <TFile.h>
+#include <TTree.h>
+#include <TTreeReader.h>
+#include <TTreeReaderValue.h>
+#include "HHStatAnalysis/Core/interface/exception.h"
+#include "HHStatAnalysis/StatModels/interface/ThreadPool.h"
+#include "HHStatAnalysis/StatModels/interface/RootThreads.h"
+
+namespace hh_analysis {
+namespace combine_limits {
+
+const std::vector<double> all_limit_quantiles = { -1., 0.025, 0.16, 0.5, 0.84, 0.975 };
+const std::vector<std::string> all_limit_quantile_names = { "obs", "exp-2", "exp-1", "exp0", "exp+1", "exp+2" };
+
+inline size_t GetQuantileId(double quantile)
+{
+    static const double delta = 0.01;
+    for(size_t n = 0; n < all_limit_quantiles.size(); ++n) {
+        if(std::abs(all_limit_quantiles[n] - quantile) < delta)
+            return n;
+    }
+    throw analysis::exception("Unknown quantile = %1%") % quantile;
+}
+
+inline double GetHiggsMass(const std::string& file_name)
+{
+    static const std::vector<boost::regex> mass_patterns = { boost::regex("mR([0-9]*)"), boost::regex("mH([0-9]*)") };
+    for(const auto& pattern : mass_patterns) {
+        boost::smatch mass_match;
+        if(boost::regex_search(file_name, mass_match, pattern)) {
+            std::istringstream ss_mass(mass_match[1]);
+            double mass;
+            ss_mass >> mass;
+            return mass;
+        }
+    }
+    throw analysis::exception("Bad file name %1%") % file_name;
+}
+
+struct LimitFileEntry {
+    double mass;
+    std::string file_name;
+
+    LimitFileEntry(double _mass, const std::string& _file_name) : mass(_mass), file_name(_file_name) {}
+
+    bool operator<(const LimitFileEntry& other) const
+    {
+        if(mass != other.mass) return mass < other.mass;
+        return file_name < other.file_name;
+    }
+};
+
+using LimitFileList = std::vector<LimitFileEntry>;
+
+// Single pass over the directory. Files are ordered by mass and then by name.
+inline LimitFileList GetOrderedFileList(const std::string& input_dir_name, const std::string& pattern_str)
+{
+    using namespace boost::filesystem;
+    LimitFileList files;
+    const boost::regex pattern(pattern_str);
+    const path input_dir(input_dir_name);
+    const directory_iterator end_iter;
+    for(directory_iterator file_iter(input_dir); file_iter != end_iter; ++file_iter) {
+        const auto& name = file_iter->path().string();
+        if(boost::regex_match(name, pattern) && is_regular_file(file_iter->status()))
+            files.push_back(LimitFileEntry(GetHiggsMass(name), name));
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// Limit values for each quantile in the order in which they are stored in the file.
+using QuantileLimits = std::vector<std::vector<double>>;
+
+inline QuantileLimits ReadLimitFile(const std::string& file_name)
+{
+    std::shared_ptr<TFile> file(TFile::Open(file_name.c_str(), "READ"));
+    if(!file || file->IsZombie())
+        throw analysis::exception("Unable to open limit file '%1%'.") % file_name;
+    TTree* tree = dynamic_cast<TTree*>(file->Get("limit"));
+    if(!tree)
+        throw analysis::exception("Limit tree not found in '%1%'.") % file_name;
+
+    QuantileLimits limits(all_limit_quantiles.size());
+    TTreeReader reader(tree);
+    TTreeReaderValue<double> limit(reader, "limit");
+    TTreeReaderValue<float> quantile_expected(reader, "quantileExpected");
+    while(reader.Next())
+        limits.at(GetQuantileId(*quantile_expected)).push_back(*limit);
+    return limits;
+}
+
+// Size and modification time in nanoseconds of a file. Returns false if the file status can't be read.
+inline bool GetFileStatus(const std::string& file_name, uint64_t& size, int64_t& mtime_ns)
+{
+    struct stat file_stat;
+    if(stat(file_name.c_str(), &file_stat) != 0)
+        return false;
+    size = static_cast<uint64_t>(file_stat.st_size);
+    mtime_ns = static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+    return true;
+}
+
+// Binary index of the limit files: for each file its size, modification time in nanoseconds, mass and limit values.
+// The index is only a cache: if it can't be read or written, limits are simply read from the original files.
+// Counts stored in the index are checked against the remaining size of the file before anything is allocated, so
+// a truncated or corrupted index is ignored and then rebuilt.
+class LimitIndexCache {
+public:
+    struct Entry {
+        uint64_t size;
+        int64_t mtime;
+        double mass;
+        QuantileLimits limits;
+    };
+
+    explicit LimitIndexCache(const std::string& _cache_file) : cache_file(_cache_file)
+    {
+        try {
+            Load();
+        } catch(std::exception& e) {
+            entries.clear();
+            std::cerr << "WARNING: limit cache '" << cache_file << "' is ignored: " << e.what() << "." << std::endl;
+        }
+    }
+
+    const Entry* Find(const std::string& file_name, uint64_t size, int64_t mtime) const
+    {
+        const auto iter = entries.find(file_name);
+        if(iter == entries.end() || iter->second.size != size || iter->second.mtime != mtime)
+            return nullptr;
+        return &iter->second;
+    }
+
+    // Replaces the cache content. Entries are written in the order of the file list.
+    void Save(const LimitFileList& files, const std::vector<Entry>& new_entries)
+    {
+        entries.clear();
+        for(size_t n = 0; n < files.size(); ++n)
+            entries[files.at(n).file_name] = new_entries.at(n);
+        const std::string tmp_file = cache_file + ".tmp";
+        try {
+            {
+                std::ofstream stream(tmp_file, std::ios::binary | std::ios::trunc);
+                if(!stream.is_open())
+                    throw analysis::exception("unable to create the file");
+                stream.write(Magic(), MagicSize());
+                Write<uint32_t>(stream, Version());
+                Write<uint64_t>(stream, files.size());
+                for(size_t n = 0; n < files.size(); ++n)
+                    WriteEntry(stream, files.at(n).file_name, new_entries.at(n));
+                if(!stream.good())
+                    throw analysis::exception("write error");
+            }
+            if(std::rename(tmp_file.c_str(), cache_file.c_str()))
+                throw analysis::exception("unable to replace the file");
+        } catch(std::exception& e) {
+            std::remove(tmp_file.c_str());
+            std::cerr << "WARNING: limit cache '" << cache_file << "' is not updated: " << e.what() << "." << std::endl;
+        }
+    }
+
+private:
+    static const char* Magic() { return "HHLIMIDX"; }
+    static constexpr size_t MagicSize() { return 8; }
+    static constexpr uint32_t Version() { return 2; }
+
+    template<typename T>
+    static void Write(std::ostream& stream, const T& value)
+    {
+        stream.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template<typename T>
+    static T Read(std::istream& stream)
+    {
+        T value;
+        stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+        if(!stream.good())
+            throw analysis::exception("unexpected end of file");
+        return value;
+    }
+
+    static void CheckAvailable(std::istream& stream, uint64_t file_size, uint64_t n_items, uint64_t item_size)
+    {
+        const std::streamoff pos = stream.tellg();
+        if(pos < 0 || static_cast<uint64_t>(pos) > file_size || n_items > (file_size - pos) / item_size)
+            throw analysis::exception("inconsistent size of the stored data");
+    }
+
+    static void WriteEntry(std::ostream& stream, const std::string& file_name, const Entry& entry)
+    {
+        Write<uint32_t>(stream, static_cast<uint32_t>(file_name.size()));
+        stream.write(file_name.data(), static_cast<std::streamsize>(file_name.size()));
+        Write<uint64_t>(stream, entry.size);
+        Write<int64_t>(stream, entry.mtime);
+        Write<double>(stream, entry.mass);
+        Write<uint32_t>(stream, static_cast<uint32_t>(entry.limits.size()));
+        for(const auto& quantile_limits : entry.limits) {
+            Write<uint32_t>(stream, static_cast<uint32_t>(quantile_limits.size()));
+            stream.write(reinterpret_cast<const char*>(quantile_limits.data()),
+                         static_cast<std::streamsize>(quantile_limits.size() * sizeof(double)));
+        }
+    }
+
+    void Load()
+    {
+        std::ifstream stream(cache_file, std::ios::binary | std::ios::ate);
+        if(!stream.is_open()) return;
+        const std::streamoff file_size = stream.tellg();
+        if(file_size < 0)
+            throw analysis::exception("unable to get the file size");
+        stream.seekg(0);
+        char magic[MagicSize()];
+        stream.read(magic, MagicSize());
+        if(!stream.good() || std::string(magic, MagicSize()) != Magic())
+            throw analysis::exception("bad file format");
+        const uint32_t version = Read<uint32_t>(stream);
+        if(version != Version())
+            throw analysis::exception("unsupported version %1%") % version;
+        const uint64_t n_entries = Read<uint64_t>(stream);
+        static constexpr uint64_t min_entry_size = 3 * sizeof(uint32_t) + sizeof(uint64_t) + sizeof(int64_t)
+                + sizeof(double);
+        CheckAvailable(stream, file_size, n_entries, min_entry_size);
+        for(uint64_t n = 0; n < n_entries; ++n) {
+            const uint32_t name_size = Read<uint32_t>(stream);
+            CheckAvailable(stream, file_size, name_size, 1);
+            std::string file_name(name_size, '\0');
+            stream.read(&file_name[0], static_cast<std::streamsize>(file_name.size()));
+            Entry entry;
+            entry.size = Read<uint64_t>(stream);
+            entry.mtime = Read<int64_t>(stream);
+            entry.mass = Read<double>(stream);
+            const uint32_t n_quantiles = Read<uint32_t>(stream);
+            if(n_quantiles != all_limit_quantiles.size())
+                throw analysis::exception("inconsistent number of quantiles");
+            entry.limits.resize(n_quantiles);
+            for(auto& quantile_limits : entry.limits) {
+                const uint32_t n_limits = Read<uint32_t>(stream);
+                CheckAvailable(stream, file_size, n_limits, sizeof(double));
+                quantile_limits.resize(n_limits);
+                stream.read(reinterpret_cast<char*>(quantile_limits.data()),
+                            static_cast<std::streamsize>(quantile_limits.size() * sizeof(double)));
+            }
+            if(!stream.good())
+                throw analysis::exception("unexpected end of file");
+            entries[file_name] = entry;
+        }
+    }
+
+private:
+    std::string cache_file;
+    std::unordered_map<std::string, Entry> entries;
+};
+
+// Files are read concurrently. The result is ordered as the input list.
+// If the cache file is specified, only files that are not in the cache or that were changed since the cache
+// creation are read. The number of files taken from the cache is stored into n_cached.
+inline std::vector<QuantileLimits> ReadLimitFiles(const LimitFileList& files, ThreadPool& pool,
+                                                  const std::string& cache_file = "", size_t* n_cached = nullptr)
+{
+    std::vector<QuantileLimits> limits(files.size());
+    std::vector<LimitIndexCache::Entry> entries(files.size());
+    std::vector<size_t> files_to_read;
+    std::shared_ptr<LimitIndexCache> cache;
+    if(cache_file.size())
+        cache = std::make_shared<LimitIndexCache>(cache_file);
+
+    for(size_t n = 0; n < files.size(); ++n) {
+        if(!cache) {
+            files_to_read.push_back(n);
+            continue;
+        }
+        const std::string& file_name = files.at(n).file_name;
+        LimitIndexCache::Entry& entry = entries.at(n);
+        if(!GetFileStatus(file_name, entry.size, entry.mtime))
+            throw analysis::exception("Unable to get status of the limit file '%1%'.") % file_name;
+        entry.mass = files.at(n).mass;
+        const LimitIndexCache::Entry* cached_entry = cache->Find(file_name, entry.size, entry.mtime);
+        if(cached_entry && cached_entry->mass == entry.mass)
+            limits.at(n) = cached_entry->limits;
+        else
+            files_to_read.push_back(n);
+    }
+
+    if(files_to_read.size() > 1 && pool.GetNumberOfThreads() > 1)
+        EnableRootThreadSafety();
+    pool.ParallelFor(files_to_read.size(), [&](size_t n) {
+        const size_t file_id = files_to_read.at(n);
+        limits.at(file_id) = ReadLimitFile(files.at(file_id).file_name);
+    });
+
+    if(n_cached)
+        *n_cached = files.size() - files_to_read.size();
+    if(cache && files_to_read.size()) {
+        for(size_t n = 0; n < files.size(); ++n)
+            entries.at(n).limits = limits.at(n);
+        cache->Save(files, entries);
+    }
+    return limits;
+}
+
+} // namespace combine_limits
+} // namespace hh_analysis
@@ -0,0 +1,177 @@
+/*! Definition of the marching squares extraction of contour lines from values on a rectilinear 2D grid.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <unordered_map>
+#include <cstdint>
+#include "HHStatAnalysis/Core/interface/exception.h"
+
+namespace hh_analysis {
+
+struct ContourLine {
+    std::vector<double> x, y;
+    bool closed;
+
+    ContourLine() : closed(false) {}
+    size_t size() const { return x.size(); }
+};
+
+// Values are stored in x-major order (index = x_id * n_y + y_id), as in GridInterpolator.
+// Cells with at least one missing (NaN) corner are skipped, so lines end at the border of the defined region.
+// Crossing points on the cell edges are found by the linear interpolation and the saddle cells are resolved
+// using the average of the cell corners. Segments that share an edge are joined into continuous lines.
+class ContourExtractor {
+public:
+    ContourExtractor(const std::vector<double>& _x_nodes, const std::vector<double>& _y_nodes)
+        : x_nodes(_x_nodes), y_nodes(_y_nodes)
+    {
+        if(x_nodes.size() < 2 || y_nodes.size() < 2)
+            throw analysis::exception("At least 2x2 grid is required to extract contours.");
+    }
+
+    std::vector<ContourLine> Extract(const std::vector<double>& values, double level) const
+    {
+        if(values.size() != x_nodes.size() * y_nodes.size())
+            throw analysis::exception("Number of values = %1% is not compatible with the grid size = %2%.")
+                % values.size() % (x_nodes.size() * y_nodes.size());
+
+        std::vector<Segment> segments;
+        for(size_t i = 0; i + 1 < x_nodes.size(); ++i) {
+            for(size_t j = 0; j + 1 < y_nodes.size(); ++j)
+                ProcessCell(values, level, i, j, segments);
+        }
+        return JoinSegments(values, level, segments);
+    }
+
+private:
+    using EdgeId = uint64_t;
+
+    struct Segment {
+        EdgeId a, b;
+    };
+
+    // Edge (i, j) - (i + 1, j) is horizontal, edge (i, j) - (i, j + 1) is vertical.
+    EdgeId HorizontalEdge(size_t i, size_t j) const { return 2 * (i * y_nodes.size() + j); }
+    EdgeId VerticalEdge(size_t i, size_t j) const { return 2 * (i * y_nodes.size() + j) + 1; }
+    double Value(const std::vector<double>& values, size_t i, size_t j) const { return values[i * y_nodes.size() + j]; }
+
+    void ProcessCell(const std::vector<double>& values, double level, size_t i, size_t j,
+                     std::vector<Segment>& segments) const
+    {
+        const double v00 = Value(values, i, j), v10 = Value(values, i + 1, j);
+        const double v11 = Value(values, i + 1, j + 1), v01 = Value(values, i, j + 1);
+        if(std::isnan(v00) || std::isnan(v10) || std::isnan(v11) || std::isnan(v01)) return;
+
+        const unsigned cell_case = (v00 >= level ? 1 : 0) | (v10 >= level ? 2 : 0) | (v11 >= level ? 4 : 0)
+                | (v01 >= level ? 8 : 0);
+        if(cell_case == 0 || cell_case == 15) return;
+
+        const EdgeId bottom = HorizontalEdge(i, j), top = HorizontalEdge(i, j + 1);
+        const EdgeId left = VerticalEdge(i, j), right = VerticalEdge(i + 1, j);
+        const bool center_above = (v00 + v10 + v11 + v01) / 4 >= level;
+
+        switch(cell_case) {
+            case 1: case 14: segments.push_back(Segment{ left, bottom }); break;
+            case 2: case 13: segments.push_back(Segment{ bottom, right }); break;
+            case 3: case 12: segments.push_back(Segment{ left, right }); break;
+            case 4: case 11: segments.push_back(Segment{ right, top }); break;
+            case 6: case 9: segments.push_back(Segment{ bottom, top }); break;
+            case 7: case 8: segments.push_back(Segment{ left, top }); break;
+            case 5:
+                if(center_above) {
+                    segments.push_back(Segment{ left, top });
+                    segments.push_back(Segment{ bottom, right });
+                } else {
+                    segments.push_back(Segment{ left, bottom });
+                    segments.push_back(Segment{ right, top });
+                }
+                break;
+            case 10:
+                if(center_above) {
+                    segments.push_back(Segment{ left, bottom });
+                    segments.push_back(Segment{ right, top });
+                } else {
+                    segments.push_back(Segment{ left, top });
+                    segments.push_back(Segment{ bottom, right });
+                }
+                break;
+        }
+    }
+
+    void AddEdgePoint(const std::vector<double>& values, double level, EdgeId edge, ContourLine& line) const
+    {
+        const size_t node = static_cast<size_t>(edge / 2);
+        const size_t i = node / y_nodes.size(), j = node % y_nodes.size();
+        const bool vertical = edge % 2;
+        const size_t i2 = vertical ? i : i + 1, j2 = vertical ? j + 1 : j;
+        const double v1 = Value(values, i, j), v2 = Value(values, i2, j2);
+        const double t = v2 != v1 ? (level - v1) / (v2 - v1) : 0.5;
+        line.x.push_back(x_nodes[i] + t * (x_nodes[i2] - x_nodes[i]));
+        line.y.push_back(y_nodes[j] + t * (y_nodes[j2] - y_nodes[j]));
+    }
+
+    std::vector<ContourLine> JoinSegments(const std::vector<double>& values, double level,
+                                          const std::vector<Segment>& segments) const
+    {
+        // Each edge is shared by at most two segments.
+        std::unordered_map<EdgeId, std::pair<size_t, size_t>> edge_segments;
+        const size_t none = segments.size();
+        for(size_t n = 0; n < segments.size(); ++n) {
+            for(EdgeId edge : { segments[n].a, segments[n].b }) {
+                auto iter = edge_segments.find(edge);
+                if(iter == edge_segments.end())
+                    edge_segments[edge] = std::make_pair(n, none);
+                else
+                    iter->second.second = n;
+            }
+        }
+
+        std::vector<bool> used(segments.size(), false);
+        std::vector<ContourLine> lines;
+        // Open lines start at the edge that belongs to a single segment. Remaining segments form closed lines.
+        for(size_t pass = 0; pass < 2; ++pass) {
+            for(size_t n = 0; n < segments.size(); ++n) {
+                if(used[n]) continue;
+                EdgeId start = segments[n].a;
+                if(pass == 0) {
+                    if(edge_segments.at(segments[n].a).second == none)
+                        start = segments[n].a;
+                    else if(edge_segments.at(segments[n].b).second == none)
+                        start = segments[n].b;
+                    else
+                        continue;
+                }
+                lines.push_back(TraceLine(values, level, segments, edge_segments, n, start, used));
+            }
+        }
+        return lines;
+    }
+
+    ContourLine TraceLine(const std::vector<double>& values, double level, const std::vector<Segment>& segments,
+                          const std::unordered_map<EdgeId, std::pair<size_t, size_t>>& edge_segments,
+                          size_t first_segment, EdgeId start, std::vector<bool>& used) const
+    {
+        const size_t none = segments.size();
+        ContourLine line;
+        AddEdgePoint(values, level, start, line);
+        size_t current = first_segment;
+        EdgeId edge = start;
+        while(current != none && !used[current]) {
+            used[current] = true;
+            edge = segments[current].a == edge ? segments[current].b : segments[current].a;
+            AddEdgePoint(values, level, edge, line);
+            const auto& neighbours = edge_segments.at(edge);
+            current = neighbours.first == current ? neighbours.second : neighbours.first;
+        }
+        line.closed = edge == start && line.size() > 2;
+        return line;
+    }
+
+private:
+    std::vector<double> x_nodes, y_nodes;
+};
+
+} // namespace hh_analysis
@@ -0,0 +1,304 @@
+/*! Definition of the 2D Delaunay triangulation with a reusable point location.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+#include <limits>
+#include "HHStatAnalysis/Core/interface/exception.h"
+
+namespace hh_analysis {
+
+// Incremental (Bowyer-Watson) Delaunay triangulation of a scattered set of points.
+// As in TGraph2D, coordinates are normalized to the unit square before the triangulation, so that the result
+// does not depend on the relative scale of x and y. Duplicated points are ignored: the first occurrence is kept.
+// The triangulation is built once and can be used to locate any number of query points. The located triangles
+// and barycentric weights are stored in an InterpolationPlan, which can be applied to any number of value
+// vectors defined on the original points.
+class DelaunayTriangulation {
+public:
+    struct InterpolationPlan {
+        static constexpr size_t NoVertex() { return std::numeric_limits<size_t>::max(); }
+
+        std::vector<size_t> vertices;
+        std::vector<double> weights;
+
+        size_t size() const { return vertices.size() / 3; }
+
+        // Linear interpolation of the values on the query points. Points outside of the convex hull are NaN.
+        std::vector<double> Apply(const std::vector<double>& values) const
+        {
+            std::vector<double> result(size());
+            for(size_t n = 0; n < result.size(); ++n) {
+                const size_t* v = &vertices[3 * n];
+                const double* w = &weights[3 * n];
+                result[n] = v[0] == NoVertex() ? std::numeric_limits<double>::quiet_NaN()
+                                             : w[0] * values.at(v[0]) + w[1] * values.at(v[1]) + w[2] * values.at(v[2]);
+            }
+            return result;
+        }
+    };
+
+    DelaunayTriangulation(const std::vector<double>& x, const std::vector<double>& y)
+        : last_triangle(0)
+    {
+        if(x.size() != y.size())
+            throw analysis::exception("Inconsistent number of x and y coordinates.");
+        if(x.size() < 3)
+            throw analysis::exception("At least 3 points are required to build a triangulation.");
+
+        const auto x_range = std::minmax_element(x.begin(), x.end());
+        const auto y_range = std::minmax_element(y.begin(), y.end());
+        x_offset = *x_range.first;
+        y_offset = *y_range.first;
+        x_scale = *x_range.second > *x_range.first ? 1. / (*x_range.second - *x_range.first) : 1.;
+        y_scale = *y_range.second > *y_range.first ? 1. / (*y_range.second - *y_range.first) : 1.;
+
+        n_input_points = x.size();
+        points.reserve(n_input_points + 3);
+        for(size_t n = 0; n < n_input_points; ++n)
+            points.push_back(Normalize(x[n], y[n]));
+        points.push_back(Point{ -super_size, -super_size });
+        points.push_back(Point{ super_size, -super_size });
+        points.push_back(Point{ 0.5, super_size });
+        triangles.push_back(Triangle{ { n_input_points, n_input_points + 1, n_input_points + 2 },
+                                      { NoTriangle, NoTriangle, NoTriangle }, true });
+
+        // Insertion in the sorted order keeps walks of the point location short.
+        std::vector<size_t> order(n_input_points);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return points[a].x < points[b].x || (points[a].x == points[b].x && points[a].y < points[b].y);
+        });
+        for(size_t point_id : order)
+            Insert(point_id);
+    }
+
+    size_t GetNumberOfTriangles() const
+    {
+        size_t n_triangles = 0;
+        for(const Triangle& triangle : triangles) {
+            if(triangle.alive && !HasSuperVertex(triangle))
+                ++n_triangles;
+        }
+        return n_triangles;
+    }
+
+    InterpolationPlan CreateInterpolationPlan(const std::vector<double>& x, const std::vector<double>& y) const
+    {
+        if(x.size() != y.size())
+            throw analysis::exception("Inconsistent number of x and y coordinates.");
+        InterpolationPlan plan;
+        plan.vertices.resize(3 * x.size(), InterpolationPlan::NoVertex());
+        plan.weights.resize(3 * x.size(), 0.);
+        size_t start = last_triangle;
+        for(size_t n = 0; n < x.size(); ++n) {
+            const Point p = Normalize(x[n], y[n]);
+            const size_t triangle_id = Locate(p, start);
+            if(triangle_id == NoTriangle) continue;
+            start = triangle_id;
+            const Triangle& triangle = triangles[triangle_id];
+            if(HasSuperVertex(triangle)) continue;
+            const Point& a = points[triangle.v[0]], &b = points[triangle.v[1]], &c = points[triangle.v[2]];
+            const double area = Orientation(a, b, c);
+            const double w_a = Orientation(p, b, c) / area, w_b = Orientation(a, p, c) / area;
+            for(size_t k = 0; k < 3; ++k)
+                plan.vertices[3 * n + k] = triangle.v[k];
+            plan.weights[3 * n] = w_a;
+            plan.weights[3 * n + 1] = w_b;
+            plan.weights[3 * n + 2] = 1. - w_a - w_b;
+        }
+        return plan;
+    }
+
+private:
+    static constexpr size_t NoTriangle = std::numeric_limits<size_t>::max();
+    static constexpr double super_size = 1e3;
+    static constexpr double duplicate_tolerance = 1e-12;
+
+    struct Point {
+        double x, y;
+    };
+
+    // Vertices are in counterclockwise order; neighbours[k] is the triangle opposite to the vertex v[k].
+    struct Triangle {
+        size_t v[3];
+        size_t neighbours[3];
+        bool alive;
+    };
+
+    Point Normalize(double x, double y) const
+    {
+        return Point{ (x - x_offset) * x_scale, (y - y_offset) * y_scale };
+    }
+
+    bool HasSuperVertex(const Triangle& triangle) const
+    {
+        return triangle.v[0] >= n_input_points || triangle.v[1] >= n_input_points
+                || triangle.v[2] >= n_input_points;
+    }
+
+    // Twice the signed area of the triangle (a, b, c): positive for the counterclockwise order.
+    static double Orientation(const Point& a, const Point& b, const Point& c)
+    {
+        return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    }
+
+    // Positive if p is strictly inside of the circumcircle of the counterclockwise triangle (a, b, c).
+    static double InCircle(const Point& a, const Point& b, const Point& c, const Point& p)
+    {
+        const double adx = a.x - p.x, ady = a.y - p.y;
+        const double bdx = b.x - p.x, bdy = b.y - p.y;
+        const double cdx = c.x - p.x, cdy = c.y - p.y;
+        const double ad = adx * adx + ady * ady, bd = bdx * bdx + bdy * bdy, cd = cdx * cdx + cdy * cdy;
+        return adx * (bdy * cd - bd * cdy) - ady * (bdx * cd - bd * cdx) + ad * (bdx * cdy - bdy * cdx);
+    }
+
+    // Visibility walk from the start triangle. Falls back to the linear scan if the walk does not converge.
+    size_t Locate(const Point& p, size_t start) const
+    {
+        if(start >= triangles.size() || !triangles[start].alive)
+            start = FirstAliveTriangle();
+        size_t current = start;
+        for(size_t n_steps = 0; n_steps < triangles.size(); ++n_steps) {
+            const Triangle& triangle = triangles[current];
+            size_t next = current;
+            for(size_t k = 0; k < 3; ++k) {
+                const Point& a = points[triangle.v[(k + 1) % 3]], &b = points[triangle.v[(k + 2) % 3]];
+                if(Orientation(a, b, p) < 0) {
+                    next = triangle.neighbours[k];
+                    break;
+                }
+            }
+            if(next == current)
+                return current;
+            if(next == NoTriangle)
+                return NoTriangle;
+            current = next;
+        }
+        for(size_t n = 0; n < triangles.size(); ++n) {
+            const Triangle& triangle = triangles[n];
+            if(!triangle.alive) continue;
+            const Point& a = points[triangle.v[0]], &b = points[triangle.v[1]], &c = points[triangle.v[2]];
+            if(Orientation(a, b, p) >= 0 && Orientation(b, c, p) >= 0 && Orientation(c, a, p) >= 0)
+                return n;
+        }
+        return NoTriangle;
+    }
+
+    size_t FirstAliveTriangle() const
+    {
+        for(size_t n = 0; n < triangles.size(); ++n) {
+            if(triangles[n].alive) return n;
+        }
+        throw analysis::exception("Triangulation does not contain any triangle.");
+    }
+
+    bool IsDuplicate(const Triangle& triangle, const Point& p) const
+    {
+        for(size_t k = 0; k < 3; ++k) {
+            const Point& v = points[triangle.v[k]];
+            if(std::abs(v.x - p.x) < duplicate_tolerance && std::abs(v.y - p.y) < duplicate_tolerance)
+                return true;
+        }
+        return false;
+    }
+
+    void Insert(size_t point_id)
+    {
+        const Point& p = points[point_id];
+        const size_t first = Locate(p, last_triangle);
+        if(first == NoTriangle)
+            throw analysis::exception("Unable to locate point %1% during the triangulation.") % point_id;
+        if(IsDuplicate(triangles[first], p)) return;
+
+        // The cavity consists of all connected triangles whose circumcircle contains the new point.
+        cavity.clear();
+        cavity.push_back(first);
+        triangles[first].alive = false;
+        for(size_t n = 0; n < cavity.size(); ++n) {
+            const Triangle& triangle = triangles[cavity[n]];
+            for(size_t k = 0; k < 3; ++k) {
+                const size_t neighbour_id = triangle.neighbours[k];
+                if(neighbour_id == NoTriangle || !triangles[neighbour_id].alive) continue;
+                const Triangle& neighbour = triangles[neighbour_id];
+                if(InCircle(points[neighbour.v[0]], points[neighbour.v[1]], points[neighbour.v[2]], p) > 0) {
+                    triangles[neighbour_id].alive = false;
+                    cavity.push_back(neighbour_id);
+                }
+            }
+        }
+
+        // Each boundary edge (a, b) of the cavity forms a new triangle (p, a, b).
+        boundary.clear();
+        for(size_t cavity_id : cavity) {
+            const Triangle& triangle = triangles[cavity_id];
+            for(size_t k = 0; k < 3; ++k) {
+                const size_t neighbour_id = triangle.neighbours[k];
+                if(neighbour_id != NoTriangle && !triangles[neighbour_id].alive) continue;
+                boundary.push_back(BoundaryEdge{ triangle.v[(k + 1) % 3], triangle.v[(k + 2) % 3], neighbour_id,
+                                                 cavity_id });
+            }
+        }
+
+        free_slots.insert(free_slots.end(), cavity.begin(), cavity.end());
+        edge_start.clear();
+        edge_end.clear();
+        new_triangles.clear();
+        for(const BoundaryEdge& edge : boundary) {
+            size_t new_id;
+            if(free_slots.size()) {
+                new_id = free_slots.back();
+                free_slots.pop_back();
+            } else {
+                new_id = triangles.size();
+                triangles.push_back(Triangle());
+            }
+            Triangle& triangle = triangles[new_id];
+            triangle.v[0] = point_id;
+            triangle.v[1] = edge.a;
+            triangle.v[2] = edge.b;
+            triangle.neighbours[0] = edge.outer;
+            triangle.neighbours[1] = triangle.neighbours[2] = NoTriangle;
+            triangle.alive = true;
+            if(edge.outer != NoTriangle) {
+                Triangle& outer = triangles[edge.outer];
+                for(size_t k = 0; k < 3; ++k) {
+                    if(outer.neighbours[k] == edge.old_triangle && outer.v[k] != edge.a && outer.v[k] != edge.b)
+                        outer.neighbours[k] = new_id;
+                }
+            }
+            edge_start[edge.a] = new_id;
+            edge_end[edge.b] = new_id;
+            new_triangles.push_back(new_id);
+        }
+
+        for(size_t new_id : new_triangles) {
+            Triangle& triangle = triangles[new_id];
+            triangle.neighbours[1] = edge_start.at(triangle.v[2]);
+            triangle.neighbours[2] = edge_end.at(triangle.v[1]);
+        }
+        last_triangle = new_triangles.back();
+    }
+
+private:
+    struct BoundaryEdge {
+        size_t a, b, outer, old_triangle;
+    };
+
+    size_t n_input_points;
+    double x_offset, y_offset, x_scale, y_scale;
+    std::vector<Point> points;
+    std::vector<Triangle> triangles;
+    size_t last_triangle;
+
+    std::vector<size_t> cavity, free_slots, new_triangles;
+    std::vector<BoundaryEdge> boundary;
+    std::unordered_map<size_t, size_t> edge_start, edge_end;
+};
+
+} // namespace hh_analysis
@@ -0,0 +1,173 @@
+/*! Definition of the interpolator for values defined on the nodes of a rectilinear 2D grid.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "HHStatAnalysis/Core/interface/exception.h"
+
+namespace hh_analysis {
+
+// Bilinear or bicubic interpolation that works directly on the grid indices.
+// Node values are stored in x-major order (index = x_id * n_y + y_id). Missing nodes are marked by NaN:
+// the interpolation inside a cell with a missing corner returns NaN, while missing outer neighbours reduce
+// the bicubic derivative estimate to a one-sided difference.
+// Points outside of the grid are evaluated at the nearest grid boundary.
+class GridInterpolator {
+public:
+    enum class Method { Bilinear, Bicubic };
+
+    static constexpr double NaN() { return std::numeric_limits<double>::quiet_NaN(); }
+
+    GridInterpolator(const std::vector<double>& _x_nodes, const std::vector<double>& _y_nodes, Method _method)
+        : x_nodes(_x_nodes), y_nodes(_y_nodes), method(_method), values(x_nodes.size() * y_nodes.size(), NaN())
+    {
+        CheckNodes(x_nodes, "x");
+        CheckNodes(y_nodes, "y");
+    }
+
+    const std::vector<double>& GetXNodes() const { return x_nodes; }
+    const std::vector<double>& GetYNodes() const { return y_nodes; }
+    size_t GetIndex(size_t x_id, size_t y_id) const { return x_id * y_nodes.size() + y_id; }
+
+    void SetValues(const std::vector<double>& _values)
+    {
+        if(_values.size() != values.size())
+            throw analysis::exception("Number of values = %1% is not compatible with the grid size = %2%.")
+                % _values.size() % values.size();
+        values = _values;
+    }
+
+    void SetValue(size_t x_id, size_t y_id, double value) { values.at(GetIndex(x_id, y_id)) = value; }
+    double GetValue(size_t x_id, size_t y_id) const { return values.at(GetIndex(x_id, y_id)); }
+
+    double Interpolate(double x, double y) const
+    {
+        return Evaluate(FindStencil(x_nodes, x), FindStencil(y_nodes, y));
+    }
+
+    // Interpolates values on the output grid x_out (x) y_out. The result is stored in x-major order.
+    // Axis stencils are found once per output coordinate, so for sorted coordinates the total cost is linear
+    // in the size of the output grid.
+    std::vector<double> Interpolate(const std::vector<double>& x_out, const std::vector<double>& y_out) const
+    {
+        const auto x_stencils = FindStencils(x_nodes, x_out);
+        const auto y_stencils = FindStencils(y_nodes, y_out);
+        std::vector<double> result(x_out.size() * y_out.size());
+        for(size_t x_id = 0; x_id < x_stencils.size(); ++x_id) {
+            for(size_t y_id = 0; y_id < y_stencils.size(); ++y_id)
+                result[x_id * y_out.size() + y_id] = Evaluate(x_stencils[x_id], y_stencils[y_id]);
+        }
+        return result;
+    }
+
+private:
+    struct Stencil {
+        size_t cell;
+        double t;
+    };
+
+    static void CheckNodes(const std::vector<double>& nodes, const std::string& axis_name)
+    {
+        if(nodes.size() < 2)
+            throw analysis::exception("At least two grid nodes along %1% axis are required.") % axis_name;
+        for(size_t n = 1; n < nodes.size(); ++n) {
+            if(!(nodes[n] > nodes[n - 1]))
+                throw analysis::exception("Grid nodes along %1% axis are not strictly increasing.") % axis_name;
+        }
+    }
+
+    static Stencil MakeStencil(const std::vector<double>& nodes, size_t cell, double v)
+    {
+        const double t = (v - nodes[cell]) / (nodes[cell + 1] - nodes[cell]);
+        return Stencil{ cell, std::min(std::max(t, 0.), 1.) };
+    }
+
+    static Stencil FindStencil(const std::vector<double>& nodes, double v)
+    {
+        const auto iter = std::upper_bound(nodes.begin(), nodes.end(), v);
+        const size_t upper = static_cast<size_t>(std::distance(nodes.begin(), iter));
+        const size_t cell = std::min(std::max<size_t>(upper, 1), nodes.size() - 1) - 1;
+        return MakeStencil(nodes, cell, v);
+    }
+
+    static std::vector<Stencil> FindStencils(const std::vector<double>& nodes, const std::vector<double>& points)
+    {
+        std::vector<Stencil> stencils;
+        stencils.reserve(points.size());
+        size_t cell = 0;
+        for(size_t n = 0; n < points.size(); ++n) {
+            if(n && points[n] < points[n - 1]) {
+                stencils.push_back(FindStencil(nodes, points[n]));
+                cell = stencils.back().cell;
+                continue;
+            }
+            while(cell + 2 < nodes.size() && points[n] >= nodes[cell + 1])
+                ++cell;
+            stencils.push_back(MakeStencil(nodes, cell, points[n]));
+        }
+        return stencils;
+    }
+
+    double Value(ptrdiff_t x_id, ptrdiff_t y_id) const
+    {
+        if(x_id < 0 || y_id < 0 || x_id >= static_cast<ptrdiff_t>(x_nodes.size())
+                || y_id >= static_cast<ptrdiff_t>(y_nodes.size()))
+            return NaN();
+        return values[GetIndex(static_cast<size_t>(x_id), static_cast<size_t>(y_id))];
+    }
+
+    static double NodePosition(const std::vector<double>& nodes, ptrdiff_t id)
+    {
+        if(id < 0 || id >= static_cast<ptrdiff_t>(nodes.size()))
+            return NaN();
+        return nodes[static_cast<size_t>(id)];
+    }
+
+    // Cubic Hermite interpolation inside [p0, p1] with the node derivatives estimated by finite differences.
+    // f_m and f_p are values at the outer neighbours p_m and p_p, which can be missing (NaN).
+    static double Cubic(double p_m, double p0, double p1, double p_p, double f_m, double f0, double f1, double f_p,
+                        double t)
+    {
+        if(std::isnan(f0) || std::isnan(f1))
+            return NaN();
+        const double h = p1 - p0;
+        const double slope = (f1 - f0) / h;
+        const double d0 = std::isnan(f_m) ? slope : (f1 - f_m) / (p1 - p_m);
+        const double d1 = std::isnan(f_p) ? slope : (f_p - f0) / (p_p - p0);
+        const double t2 = t * t, t3 = t2 * t;
+        return (2 * t3 - 3 * t2 + 1) * f0 + (t3 - 2 * t2 + t) * h * d0 + (-2 * t3 + 3 * t2) * f1
+                + (t3 - t2) * h * d1;
+    }
+
+    double Evaluate(const Stencil& sx, const Stencil& sy) const
+    {
+        const ptrdiff_t i = static_cast<ptrdiff_t>(sx.cell), j = static_cast<ptrdiff_t>(sy.cell);
+        if(method == Method::Bilinear) {
+            const double f00 = Value(i, j), f01 = Value(i, j + 1);
+            const double f10 = Value(i + 1, j), f11 = Value(i + 1, j + 1);
+            return (1 - sx.t) * ((1 - sy.t) * f00 + sy.t * f01) + sx.t * ((1 - sy.t) * f10 + sy.t * f11);
+        }
+
+        const double y_m = NodePosition(y_nodes, j - 1), y0 = y_nodes[sy.cell], y1 = y_nodes[sy.cell + 1],
+                     y_p = NodePosition(y_nodes, j + 2);
+        double f_x[4];
+        for(ptrdiff_t k = 0; k < 4; ++k) {
+            const ptrdiff_t x_id = i - 1 + k;
+            f_x[k] = Cubic(y_m, y0, y1, y_p, Value(x_id, j - 1), Value(x_id, j),
+                           Value(x_id, j + 1), Value(x_id, j + 2), sy.t);
+        }
+        return Cubic(NodePosition(x_nodes, i - 1), x_nodes[sx.cell], x_nodes[sx.cell + 1],
+                     NodePosition(x_nodes, i + 2), f_x[0], f_x[1], f_x[2], f_x[3], sx.t);
+    }
+
+private:
+    std::vector<double> x_nodes, y_nodes;
+    Method method;
+    std::vector<double> values;
+};
+
+} // namespace hh_analysis
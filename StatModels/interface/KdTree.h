@@ -0,0 +1,202 @@
+/*! Definition of the k-d tree for the range and nearest neighbour queries over multidimensional points.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <queue>
+#include "HHStatAnalysis/Core/interface/exception.h"
+
+namespace hh_analysis {
+
+// Static k-d tree built once over a fixed set of points. Points are given as columns: coordinates[dim][point_id].
+// The tree is stored implicitly in the permutation of the point ids: each range is split at its median along
+// the dimension with the largest spread. Points with NaN coordinates are not indexed.
+// Distances for the nearest neighbour search and spreads for the splits are computed using the per-dimension
+// scales (1 by default), which allows to combine dimensions with different units. A dimension with zero scale is
+// ignored by the distance and is not used for the splits if any other dimension has a nonzero scale.
+// Query results are point ids in the original order of the columns. Queries can be run concurrently.
+class KdTree {
+public:
+    using Point = std::vector<double>;
+
+    explicit KdTree(const std::vector<std::vector<double>>& _coordinates, const std::vector<double>& _scales = {})
+        : coordinates(_coordinates), scales(_scales)
+    {
+        if(coordinates.empty())
+            throw analysis::exception("Points for the k-d tree should have at least one dimension.");
+        const size_t n_points = coordinates.front().size();
+        for(const auto& column : coordinates) {
+            if(column.size() != n_points)
+                throw analysis::exception("Inconsistent number of coordinates for the k-d tree.");
+        }
+        if(scales.empty())
+            scales.assign(coordinates.size(), 1.);
+        if(scales.size() != coordinates.size())
+            throw analysis::exception("Inconsistent number of scales for the k-d tree.");
+
+        for(size_t n = 0; n < n_points; ++n) {
+            bool valid = true;
+            for(const auto& column : coordinates)
+                valid = valid && !std::isnan(column[n]);
+            if(valid)
+                order.push_back(n);
+        }
+        split_dims.resize(order.size());
+        Build(0, order.size());
+    }
+
+    size_t GetNumberOfDimensions() const { return coordinates.size(); }
+    size_t GetNumberOfIndexedPoints() const { return order.size(); }
+
+    // Ids of all points inside of the box [min, max] (borders are included), in the increasing order.
+    std::vector<size_t> FindInBox(const Point& min, const Point& max) const
+    {
+        CheckDimension(min);
+        CheckDimension(max);
+        std::vector<size_t> result;
+        FindInBox(0, order.size(), min, max, result);
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    // Ids of up to k nearest points ordered by the distance. Points at the same distance are ordered by id.
+    std::vector<size_t> FindNearest(const Point& point, size_t k) const
+    {
+        CheckDimension(point);
+        std::priority_queue<Candidate> candidates;
+        if(k)
+            FindNearest(0, order.size(), point, k, candidates);
+        std::vector<size_t> result(candidates.size());
+        for(size_t n = result.size(); n > 0; --n) {
+            result[n - 1] = candidates.top().id;
+            candidates.pop();
+        }
+        return result;
+    }
+
+private:
+    static constexpr size_t LeafSize() { return 8; }
+
+    struct Candidate {
+        double distance;
+        size_t id;
+        bool operator<(const Candidate& other) const
+        {
+            return distance < other.distance || (distance == other.distance && id < other.id);
+        }
+    };
+
+    void CheckDimension(const Point& point) const
+    {
+        if(point.size() != coordinates.size())
+            throw analysis::exception("Query point has dimension %1% instead of %2%.") % point.size()
+                % coordinates.size();
+    }
+
+    void Build(size_t begin, size_t end)
+    {
+        if(end - begin <= LeafSize()) return;
+        size_t split_dim = 0;
+        double max_spread = -1;
+        for(size_t dim = 0; dim < coordinates.size(); ++dim) {
+            const auto& column = coordinates[dim];
+            const auto range = std::minmax_element(order.begin() + begin, order.begin() + end,
+                                                   [&](size_t a, size_t b) { return column[a] < column[b]; });
+            const double spread = (column[*range.second] - column[*range.first]) * std::abs(scales[dim]);
+            if(spread > max_spread) {
+                max_spread = spread;
+                split_dim = dim;
+            }
+        }
+        const size_t mid = (begin + end) / 2;
+        const auto& column = coordinates[split_dim];
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                         [&](size_t a, size_t b) { return column[a] < column[b]; });
+        split_dims[mid] = split_dim;
+        Build(begin, mid);
+        Build(mid + 1, end);
+    }
+
+    bool IsInBox(size_t id, const Point& min, const Point& max) const
+    {
+        for(size_t dim = 0; dim < coordinates.size(); ++dim) {
+            const double value = coordinates[dim][id];
+            if(value < min[dim] || value > max[dim]) return false;
+        }
+        return true;
+    }
+
+    void FindInBox(size_t begin, size_t end, const Point& min, const Point& max, std::vector<size_t>& result) const
+    {
+        if(end - begin <= LeafSize()) {
+            for(size_t n = begin; n < end; ++n) {
+                if(IsInBox(order[n], min, max))
+                    result.push_back(order[n]);
+            }
+            return;
+        }
+        const size_t mid = (begin + end) / 2, dim = split_dims[mid];
+        const double split_value = coordinates[dim][order[mid]];
+        if(IsInBox(order[mid], min, max))
+            result.push_back(order[mid]);
+        if(min[dim] <= split_value)
+            FindInBox(begin, mid, min, max, result);
+        if(max[dim] >= split_value)
+            FindInBox(mid + 1, end, min, max, result);
+    }
+
+    double Distance2(size_t id, const Point& point) const
+    {
+        double distance = 0;
+        for(size_t dim = 0; dim < coordinates.size(); ++dim) {
+            const double delta = (coordinates[dim][id] - point[dim]) * scales[dim];
+            distance += delta * delta;
+        }
+        return distance;
+    }
+
+    static void AddCandidate(const Candidate& candidate, size_t k, std::priority_queue<Candidate>& candidates)
+    {
+        if(candidates.size() < k) {
+            candidates.push(candidate);
+        } else if(candidate < candidates.top()) {
+            candidates.pop();
+            candidates.push(candidate);
+        }
+    }
+
+    void FindNearest(size_t begin, size_t end, const Point& point, size_t k,
+                     std::priority_queue<Candidate>& candidates) const
+    {
+        if(end - begin <= LeafSize()) {
+            for(size_t n = begin; n < end; ++n)
+                AddCandidate(Candidate{ Distance2(order[n], point), order[n] }, k, candidates);
+            return;
+        }
+        const size_t mid = (begin + end) / 2, dim = split_dims[mid];
+        const double delta = (point[dim] - coordinates[dim][order[mid]]) * scales[dim];
+        AddCandidate(Candidate{ Distance2(order[mid], point), order[mid] }, k, candidates);
+        const bool left_first = delta <= 0;
+        if(left_first)
+            FindNearest(begin, mid, point, k, candidates);
+        else
+            FindNearest(mid + 1, end, point, k, candidates);
+        if(candidates.size() < k || delta * delta <= candidates.top().distance) {
+            if(left_first)
+                FindNearest(mid + 1, end, point, k, candidates);
+            else
+                FindNearest(begin, mid, point, k, candidates);
+        }
+    }
+
+private:
+    std::vector<std::vector<double>> coordinates;
+    std::vector<double> scales;
+    std::vector<size_t> order, split_dims;
+};
+
+} // namespace hh_analysis
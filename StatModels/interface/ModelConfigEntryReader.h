@@ -36,6 +36,8 @@ public:
         CheckReadParamCounts("combine_channels", 1, Condition::less_equal);
         CheckReadParamCounts("per_channel_limits", 1, Condition::less_equal);
         CheckReadParamCounts("per_category_limits", 1, Condition::less_equal);
+        CheckReadParamCounts("n_threads", 1, Condition::less_equal);
+        CheckReadParamCounts("parallel_channels", 1, Condition::less_equal);
         CheckReadParamCounts("grid_x", 1, Condition::less_equal);
         CheckReadParamCounts("grid_y", 1, Condition::less_equal);
         CheckReadParamCounts("label_status", 1, Condition::less_equal);
@@ -69,6 +71,8 @@ public:
         ParseEntry("combine_channels", current.combine_channels);
         ParseEntry("per_channel_limits", current.per_channel_limits);
         ParseEntry("per_category_limits", current.per_category_limits);
+        ParseEntry("n_threads", current.n_threads);
+        ParseEntry("parallel_channels", current.parallel_channels);
         ParseEntry("grid_x", current.grid_x);
         ParseEntry("grid_y", current.grid_y);
         ParseEntry("label_status", current.label_status);
@@ -0,0 +1,73 @@
+/*! Definition of helpers to use ROOT from several threads.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <mutex>
+#include <RVersion.h>
+#include <TH1.h>
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+#include <TROOT.h>
+#else
+#include <TThread.h>
+#endif
+
+namespace hh_analysis {
+
+// Should be called before ROOT files are opened concurrently.
+inline void EnableRootThreadSafety()
+{
+    static std::once_flag flag;
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+    std::call_once(flag, []() { ROOT::EnableThreadSafety(); });
+#else
+    std::call_once(flag, []() { TThread::Initialize(); });
+#endif
+}
+
+// Histograms that are created or cloned while the scope exists are not added to the current directory, so they are
+// owned only by the code that creates them and no directory is modified concurrently.
+// TH1::AddDirectory is a global setting, so all scopes share a counter and the original setting is restored when the
+// last scope is destroyed.
+class HistDirectoryScope {
+public:
+    HistDirectoryScope()
+    {
+        std::lock_guard<std::mutex> lock(GetMutex());
+        if(GetCounter()++ == 0) {
+            GetStoredStatus() = TH1::AddDirectoryStatus();
+            TH1::AddDirectory(false);
+        }
+    }
+
+    HistDirectoryScope(const HistDirectoryScope&) = delete;
+    HistDirectoryScope& operator=(const HistDirectoryScope&) = delete;
+
+    ~HistDirectoryScope()
+    {
+        std::lock_guard<std::mutex> lock(GetMutex());
+        if(--GetCounter() == 0)
+            TH1::AddDirectory(GetStoredStatus());
+    }
+
+private:
+    static std::mutex& GetMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static size_t& GetCounter()
+    {
+        static size_t counter = 0;
+        return counter;
+    }
+
+    static bool& GetStoredStatus()
+    {
+        static bool status = true;
+        return status;
+    }
+};
+
+} // namespace hh_analysis
@@ -0,0 +1,148 @@
+/*! Definition of the in-memory index of the histograms stored in a ROOT file.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <TFile.h>
+#include <TKey.h>
+#include <TClass.h>
+#include <TH1.h>
+#include "HHStatAnalysis/Core/interface/RootExt.h"
+#include "ShapeSidecar.h"
+
+namespace hh_analysis {
+
+// All histograms of the file are loaded in a single pass over the keys of all directories. Keys are read in the
+// order of their position in the file, so the file is traversed sequentially. For each name only the highest
+// cycle is kept, as for TFile::Get. Loaded histograms are owned by their directories in the file, which is kept
+// open while the index exists.
+// If a valid sidecar is provided, the keys are not loaded: histograms are created from the mapped sidecar on the
+// first request and are owned by the index.
+// Objects that are not histograms are not indexed and are read from the file on request. Get can be called
+// concurrently, so the same index can be shared between several stat models.
+class ShapeIndex {
+public:
+    explicit ShapeIndex(const std::shared_ptr<TFile>& _file,
+                        const std::shared_ptr<const ShapeSidecar>& _sidecar = nullptr)
+        : file(_file), sidecar(_sidecar)
+    {
+        if(!file)
+            throw analysis::exception("Can't build shape index for nullptr file.");
+        if(sidecar) return;
+        std::vector<KeyEntry> keys;
+        CollectKeys(*file, "", keys);
+        std::sort(keys.begin(), keys.end(), [](const KeyEntry& a, const KeyEntry& b) {
+            return a.key->GetSeekKey() < b.key->GetSeekKey();
+        });
+        objects.reserve(keys.size());
+        for(const KeyEntry& entry : keys) {
+            TObject* object = entry.key->ReadObj();
+            if(!object)
+                throw analysis::exception("Unable to read object '%1%' from '%2%'.") % entry.name % file->GetName();
+            objects[entry.name] = object;
+        }
+    }
+
+    ShapeIndex(const ShapeIndex&) = delete;
+    ShapeIndex& operator=(const ShapeIndex&) = delete;
+
+    const std::shared_ptr<TFile>& GetFile() const { return file; }
+    bool HasSidecar() const { return sidecar != nullptr; }
+    size_t size() const { return sidecar ? sidecar->size() : objects.size(); }
+
+    bool Contains(const std::string& name) const
+    {
+        const std::string normalized_name = NormalizeName(name);
+        return sidecar ? sidecar->Find(normalized_name) != nullptr : objects.count(normalized_name) != 0;
+    }
+
+    // Names of the indexed histograms (from the sidecar, if it is used), in the sorted order.
+    std::vector<std::string> GetNames() const
+    {
+        std::vector<std::string> names;
+        if(sidecar) {
+            for(size_t n = 0; n < sidecar->size(); ++n)
+                names.push_back(sidecar->GetName(sidecar->GetEntry(n)));
+            return names;
+        }
+        for(const auto& object : objects)
+            names.push_back(object.first);
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+    template<typename Object>
+    Object* Get(const std::string& name) const
+    {
+        const std::string normalized_name = NormalizeName(name);
+        TObject* root_object = nullptr;
+        const auto iter = objects.find(normalized_name);
+        if(iter != objects.end()) {
+            root_object = iter->second;
+        } else {
+            std::lock_guard<std::mutex> lock(file_mutex);
+            const ShapeSidecar::Entry* entry = sidecar ? sidecar->Find(normalized_name) : nullptr;
+            if(!entry)
+                return root_ext::ReadObject<Object>(*file, name);
+            auto& hist = sidecar_objects[normalized_name];
+            if(!hist)
+                hist = sidecar->CreateHistogram(*entry);
+            root_object = hist.get();
+        }
+        Object* object = dynamic_cast<Object*>(root_object);
+        if(!object)
+            throw analysis::exception("Wrong object type '%1%' for object '%2%' in '%3%'.") % typeid(Object).name()
+                % name % file->GetName();
+        return object;
+    }
+
+private:
+    struct KeyEntry {
+        std::string name;
+        TKey* key;
+    };
+
+    static std::string NormalizeName(const std::string& name)
+    {
+        const size_t first = name.find_first_not_of('/');
+        return first == std::string::npos ? std::string() : name.substr(first);
+    }
+
+    static void CollectKeys(TDirectory& dir, const std::string& path, std::vector<KeyEntry>& keys)
+    {
+        std::unordered_map<std::string, TKey*> dir_keys;
+        TIter next(dir.GetListOfKeys());
+        while(TKey* key = dynamic_cast<TKey*>(next())) {
+            auto& best_key = dir_keys[key->GetName()];
+            if(!best_key || key->GetCycle() > best_key->GetCycle())
+                best_key = key;
+        }
+        for(const auto& dir_key : dir_keys) {
+            TKey* key = dir_key.second;
+            const std::string name = path + dir_key.first;
+            const TClass* key_class = TClass::GetClass(key->GetClassName());
+            if(!key_class) continue;
+            if(key_class->InheritsFrom(TDirectory::Class())) {
+                TDirectory* sub_dir = dir.GetDirectory(dir_key.first.c_str());
+                if(!sub_dir)
+                    throw analysis::exception("Unable to open directory '%1%' in '%2%'.") % name % dir.GetName();
+                CollectKeys(*sub_dir, name + "/", keys);
+            } else if(key_class->InheritsFrom(TH1::Class())) {
+                keys.push_back(KeyEntry{ name, key });
+            }
+        }
+    }
+
+private:
+    std::shared_ptr<TFile> file;
+    std::shared_ptr<const ShapeSidecar> sidecar;
+    std::unordered_map<std::string, TObject*> objects;
+    mutable std::unordered_map<std::string, std::unique_ptr<TH1>> sidecar_objects;
+    mutable std::mutex file_mutex;
+};
+
+} // namespace hh_analysis
@@ -0,0 +1,342 @@
+/*! Definition of the memory-mapped sidecar file with the uncompressed histograms of a shapes file.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <TH1.h>
+#include "HHStatAnalysis/Core/interface/exception.h"
+#include "HHStatAnalysis/StatModels/interface/RootThreads.h"
+
+namespace hh_analysis {
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& _file_name) : file_name(_file_name), data(nullptr), size(0)
+    {
+        const int fd = open(file_name.c_str(), O_RDONLY);
+        if(fd < 0)
+            throw analysis::exception("Unable to open '%1%': %2%.") % file_name % std::strerror(errno);
+        struct stat file_stat;
+        if(fstat(fd, &file_stat) < 0) {
+            const std::string error = std::strerror(errno);
+            close(fd);
+            throw analysis::exception("Unable to get size of '%1%': %2%.") % file_name % error;
+        }
+        size = static_cast<size_t>(file_stat.st_size);
+        if(size) {
+            void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if(address == MAP_FAILED) {
+                const std::string error = std::strerror(errno);
+                close(fd);
+                throw analysis::exception("Unable to map '%1%': %2%.") % file_name % error;
+            }
+            data = static_cast<const char*>(address);
+        }
+        close(fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        if(data)
+            munmap(const_cast<char*>(data), size);
+    }
+
+    const std::string& GetFileName() const { return file_name; }
+    const char* GetData() const { return data; }
+    size_t GetSize() const { return size; }
+
+private:
+    std::string file_name;
+    const char* data;
+    size_t size;
+};
+
+// Sidecar stores all 1D histograms of a shapes file without compression, so they can be read directly from the
+// mapped file. The layout is:
+//   header;
+//   entries, sorted by the histogram name;
+//   names and titles of the histograms (not null-terminated), padded to 8 bytes;
+//   bin contents of all histograms, including underflow and overflow bins;
+//   bin errors, in the same order as the bin contents;
+//   bin edges of all histograms.
+// The byte order is the one of the machine where the sidecar was created. The sidecar is valid only for the shapes
+// file with the same size and modification time as the ones stored in the header. The checksum of the shapes file is
+// also stored, but it is compared only if the verification is requested, because it requires to read the whole file.
+class ShapeSidecar {
+public:
+    enum class HistType : uint32_t { TH1F = 0, TH1D = 1 };
+
+    struct Header {
+        char magic[8];
+        uint64_t version, byte_order;
+        uint64_t source_size, source_mtime_ns, source_checksum;
+        uint64_t n_entries, names_size, n_values, n_edges;
+    };
+
+    struct Entry {
+        uint64_t name_offset, name_size, title_offset, title_size;
+        uint64_t values_offset, edges_offset;
+        uint32_t n_bins;
+        HistType type;
+        uint32_t variable_binning, reserved;
+        double n_entries;
+    };
+
+    static constexpr uint64_t Version() { return 3; }
+    static constexpr uint64_t ByteOrderMark() { return 0x0102030405060708; }
+    static const char* Magic() { return "HHSHAPES"; }
+    static std::string GetFileName(const std::string& source_file_name) { return source_file_name + ".sidecar"; }
+
+    // FNV-1a over 64-bit words of the file, with the trailing bytes added one by one.
+    static uint64_t ComputeChecksum(const MappedFile& file)
+    {
+        static const uint64_t prime = 0x100000001b3;
+        uint64_t hash = 0xcbf29ce484222325;
+        const size_t n_words = file.GetSize() / sizeof(uint64_t);
+        for(size_t n = 0; n < n_words; ++n) {
+            uint64_t word;
+            std::memcpy(&word, file.GetData() + n * sizeof(uint64_t), sizeof(word));
+            hash = (hash ^ word) * prime;
+        }
+        for(size_t n = n_words * sizeof(uint64_t); n < file.GetSize(); ++n)
+            hash = (hash ^ static_cast<unsigned char>(file.GetData()[n])) * prime;
+        return hash;
+    }
+
+    static uint64_t GetModificationTime(const struct stat& file_stat)
+    {
+        return static_cast<uint64_t>(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+    }
+
+    // Returns nullptr if the sidecar does not exist, has an unsupported format or was created for a different
+    // version of the shapes file. If verify is true, the checksum of the shapes file is compared as well.
+    static std::shared_ptr<ShapeSidecar> TryOpen(const std::string& source_file_name, bool verify = false)
+    {
+        const std::string file_name = GetFileName(source_file_name);
+        if(access(file_name.c_str(), R_OK) != 0)
+            return nullptr;
+        std::shared_ptr<ShapeSidecar> sidecar;
+        try {
+            sidecar.reset(new ShapeSidecar(file_name));
+        } catch(analysis::exception& e) {
+            std::cout << "[Shape sidecar] " << e.what() << " It will not be used." << std::endl;
+            return nullptr;
+        }
+        struct stat source_stat;
+        if(stat(source_file_name.c_str(), &source_stat) != 0)
+            throw analysis::exception("Unable to get status of '%1%': %2%.") % source_file_name % std::strerror(errno);
+        const Header& header = sidecar->GetHeader();
+        bool up_to_date = header.source_size == static_cast<uint64_t>(source_stat.st_size)
+                && header.source_mtime_ns == GetModificationTime(source_stat);
+        if(up_to_date && verify) {
+            const MappedFile source(source_file_name);
+            up_to_date = header.source_checksum == ComputeChecksum(source);
+        }
+        if(!up_to_date) {
+            std::cout << "[Shape sidecar] '" << file_name << "' is outdated and will not be used." << std::endl;
+            return nullptr;
+        }
+        return sidecar;
+    }
+
+    static void Write(const std::string& file_name, const std::string& source_file_name,
+                      const std::vector<std::pair<std::string, const TH1*>>& hists)
+    {
+        auto sorted_hists = hists;
+        std::sort(sorted_hists.begin(), sorted_hists.end(),
+                  [](const std::pair<std::string, const TH1*>& a, const std::pair<std::string, const TH1*>& b) {
+            return a.first < b.first;
+        });
+
+        struct stat source_stat;
+        if(stat(source_file_name.c_str(), &source_stat) != 0)
+            throw analysis::exception("Unable to get status of '%1%': %2%.") % source_file_name % std::strerror(errno);
+        const MappedFile source(source_file_name);
+        Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, Magic(), sizeof(header.magic));
+        header.version = Version();
+        header.byte_order = ByteOrderMark();
+        header.source_size = source.GetSize();
+        header.source_mtime_ns = GetModificationTime(source_stat);
+        header.source_checksum = ComputeChecksum(source);
+        header.n_entries = sorted_hists.size();
+
+        std::vector<Entry> entries;
+        std::string names;
+        std::vector<double> contents, errors, edges;
+        for(const auto& hist_entry : sorted_hists) {
+            const TH1& hist = *hist_entry.second;
+            if(hist.GetDimension() != 1)
+                throw analysis::exception("Histogram '%1%' is not 1D.") % hist_entry.first;
+            Entry entry;
+            std::memset(&entry, 0, sizeof(entry));
+            entry.name_offset = names.size();
+            entry.name_size = hist_entry.first.size();
+            const std::string title = hist.GetTitle();
+            entry.title_offset = entry.name_offset + entry.name_size;
+            entry.title_size = title.size();
+            entry.values_offset = contents.size();
+            entry.edges_offset = edges.size();
+            entry.n_bins = static_cast<uint32_t>(hist.GetNbinsX());
+            entry.type = dynamic_cast<const TH1F*>(&hist) ? HistType::TH1F : HistType::TH1D;
+            entry.variable_binning = hist.GetXaxis()->GetXbins()->GetSize() != 0;
+            entry.n_entries = hist.GetEntries();
+            names += hist_entry.first;
+            names += title;
+            for(int bin = 0; bin <= hist.GetNbinsX() + 1; ++bin) {
+                contents.push_back(hist.GetBinContent(bin));
+                errors.push_back(hist.GetBinError(bin));
+            }
+            for(int bin = 1; bin <= hist.GetNbinsX() + 1; ++bin)
+                edges.push_back(hist.GetXaxis()->GetBinLowEdge(bin));
+            entries.push_back(entry);
+        }
+        names.resize(PaddedSize(names.size()), '\0');
+        header.names_size = names.size();
+        header.n_values = contents.size();
+        header.n_edges = edges.size();
+
+        // The sidecar is written into a temporary file and renamed afterwards, so the sidecar that is mapped by
+        // another process is never modified in place.
+        const std::string tmp_file_name = file_name + ".tmp";
+        std::ofstream file(tmp_file_name, std::ios::binary | std::ios::trunc);
+        if(!file.is_open())
+            throw analysis::exception("Unable to create '%1%'.") % tmp_file_name;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(Entry));
+        file.write(names.data(), names.size());
+        file.write(reinterpret_cast<const char*>(contents.data()), contents.size() * sizeof(double));
+        file.write(reinterpret_cast<const char*>(errors.data()), errors.size() * sizeof(double));
+        file.write(reinterpret_cast<const char*>(edges.data()), edges.size() * sizeof(double));
+        file.close();
+        if(!file.good())
+            throw analysis::exception("Error while writing '%1%'.") % tmp_file_name;
+        if(std::rename(tmp_file_name.c_str(), file_name.c_str()) != 0)
+            throw analysis::exception("Unable to rename '%1%' to '%2%': %3%.") % tmp_file_name % file_name
+                % std::strerror(errno);
+    }
+
+    explicit ShapeSidecar(const std::string& file_name) : file(file_name)
+    {
+        if(file.GetSize() < sizeof(Header))
+            throw analysis::exception("Invalid shape sidecar '%1%'.") % file_name;
+        const Header& header = GetHeader();
+        if(std::memcmp(header.magic, Magic(), sizeof(header.magic)) || header.version != Version()
+                || header.byte_order != ByteOrderMark())
+            throw analysis::exception("Unsupported format of the shape sidecar '%1%'.") % file_name;
+        entries = reinterpret_cast<const Entry*>(file.GetData() + sizeof(Header));
+        names = reinterpret_cast<const char*>(entries + header.n_entries);
+        contents = reinterpret_cast<const double*>(names + header.names_size);
+        errors = contents + header.n_values;
+        edges = errors + header.n_values;
+        const size_t expected_size = sizeof(Header) + header.n_entries * sizeof(Entry) + header.names_size
+                + (2 * header.n_values + header.n_edges) * sizeof(double);
+        if(header.names_size != PaddedSize(header.names_size) || file.GetSize() != expected_size)
+            throw analysis::exception("Invalid shape sidecar '%1%'.") % file_name;
+        for(size_t n = 0; n < header.n_entries; ++n) {
+            const Entry& entry = entries[n];
+            if(entry.name_offset + entry.name_size > header.names_size
+                    || entry.title_offset + entry.title_size > header.names_size
+                    || entry.values_offset + entry.n_bins + 2 > header.n_values
+                    || entry.edges_offset + entry.n_bins + 1 > header.n_edges)
+                throw analysis::exception("Invalid entry %1% in the shape sidecar '%2%'.") % n % file_name;
+        }
+    }
+
+    ShapeSidecar(const ShapeSidecar&) = delete;
+    ShapeSidecar& operator=(const ShapeSidecar&) = delete;
+
+    const Header& GetHeader() const { return *reinterpret_cast<const Header*>(file.GetData()); }
+    size_t size() const { return GetHeader().n_entries; }
+    const Entry& GetEntry(size_t n) const { return entries[n]; }
+    std::string GetName(const Entry& entry) const { return std::string(names + entry.name_offset, entry.name_size); }
+    std::string GetTitle(const Entry& entry) const
+    {
+        return std::string(names + entry.title_offset, entry.title_size);
+    }
+
+    // Binary search over the sorted names directly in the mapped file.
+    const Entry* Find(const std::string& name) const
+    {
+        const Entry* end = entries + size();
+        const Entry* entry = std::lower_bound(entries, end, name, [&](const Entry& e, const std::string& value) {
+            return Compare(e, value) < 0;
+        });
+        return entry != end && Compare(*entry, name) == 0 ? entry : nullptr;
+    }
+
+    // Histogram is not added to any directory. Bin contents and errors are copied from the mapped arrays.
+    std::unique_ptr<TH1> CreateHistogram(const Entry& entry) const
+    {
+        std::string name = GetName(entry);
+        const size_t name_pos = name.find_last_of('/');
+        if(name_pos != std::string::npos)
+            name = name.substr(name_pos + 1);
+        const std::string title = GetTitle(entry);
+        HistDirectoryScope hist_directory_scope;
+        std::unique_ptr<TH1> hist;
+        if(entry.type == HistType::TH1F)
+            hist = CreateHistogram<TH1F>(name, title, entry);
+        else
+            hist = CreateHistogram<TH1D>(name, title, entry);
+        const double* entry_contents = contents + entry.values_offset;
+        const double* entry_errors = errors + entry.values_offset;
+        for(uint32_t bin = 0; bin <= entry.n_bins + 1; ++bin) {
+            hist->SetBinContent(static_cast<int>(bin), entry_contents[bin]);
+            hist->SetBinError(static_cast<int>(bin), entry_errors[bin]);
+        }
+        hist->SetEntries(entry.n_entries);
+        return hist;
+    }
+
+private:
+    static size_t PaddedSize(size_t size) { return (size + 7) / 8 * 8; }
+
+    int Compare(const Entry& entry, const std::string& name) const
+    {
+        const size_t common_size = std::min<size_t>(entry.name_size, name.size());
+        const int result = std::memcmp(names + entry.name_offset, name.data(), common_size);
+        if(result) return result;
+        return entry.name_size < name.size() ? -1 : entry.name_size > name.size() ? 1 : 0;
+    }
+
+    template<typename Hist>
+    std::unique_ptr<TH1> CreateHistogram(const std::string& name, const std::string& title, const Entry& entry) const
+    {
+        const double* entry_edges = edges + entry.edges_offset;
+        const int n_bins = static_cast<int>(entry.n_bins);
+        if(entry.variable_binning)
+            return std::unique_ptr<TH1>(new Hist(name.c_str(), title.c_str(), n_bins, entry_edges));
+        return std::unique_ptr<TH1>(new Hist(name.c_str(), title.c_str(), n_bins, entry_edges[0],
+                                             entry_edges[entry.n_bins]));
+    }
+
+private:
+    MappedFile file;
+    const Entry* entries;
+    const char* names;
+    const double* contents;
+    const double* errors;
+    const double* edges;
+};
+
+} // namespace hh_analysis
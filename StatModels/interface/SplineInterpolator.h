@@ -0,0 +1,226 @@
+/*! Definition of the piecewise cubic interpolator of 1D tabulated values.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "HHStatAnalysis/Core/interface/exception.h"
+
+namespace hh_analysis {
+
+// Cubic: natural cubic spline (as kCSPLINE in ROOT::Math::Interpolator).
+// Akima: Akima spline with the same end conditions as in GSL. Less prone to oscillations near outliers.
+// Pchip: monotone piecewise cubic Hermite interpolation (Fritsch-Carlson), which never overshoots the data.
+enum class SplineMethod { Cubic, Akima, Pchip };
+
+// Polynomial coefficients of each segment are computed in the constructor, so the evaluation consists of
+// the segment search and the Horner scheme. The segment search can be done once and then reused by several
+// interpolators defined on the same nodes, e.g. limits for the different quantiles as a function of mass.
+// Queries outside of the node range are evaluated to NaN.
+class SplineInterpolator {
+public:
+    static constexpr size_t NoSegment() { return std::numeric_limits<size_t>::max(); }
+    static constexpr double NaN() { return std::numeric_limits<double>::quiet_NaN(); }
+
+    SplineInterpolator(const std::vector<double>& _x, const std::vector<double>& y, SplineMethod method)
+        : x(_x)
+    {
+        if(x.size() != y.size())
+            throw analysis::exception("Inconsistent number of nodes and values.");
+        if(x.size() < 2)
+            throw analysis::exception("At least two nodes are required for the interpolation.");
+        for(size_t n = 1; n < x.size(); ++n) {
+            if(!(x[n] > x[n - 1]))
+                throw analysis::exception("Interpolation nodes are not strictly increasing.");
+        }
+
+        const size_t n_segments = x.size() - 1;
+        std::vector<double> h(n_segments), slopes(n_segments);
+        for(size_t n = 0; n < n_segments; ++n) {
+            h[n] = x[n + 1] - x[n];
+            slopes[n] = (y[n + 1] - y[n]) / h[n];
+        }
+        c0.assign(y.begin(), y.end() - 1);
+
+        if(method == SplineMethod::Cubic)
+            ComputeNaturalSpline(h, slopes);
+        else if(method == SplineMethod::Akima)
+            ComputeHermite(h, slopes, AkimaDerivatives(slopes));
+        else if(method == SplineMethod::Pchip)
+            ComputeHermite(h, slopes, PchipDerivatives(h, slopes));
+        else
+            throw analysis::exception("Unsupported spline method.");
+    }
+
+    const std::vector<double>& GetNodes() const { return x; }
+
+    double Eval(double value) const
+    {
+        size_t segment;
+        double dx;
+        Locate(&value, 1, &segment, &dx);
+        double result;
+        Eval(&segment, &dx, 1, &result);
+        return result;
+    }
+
+    void Eval(const double* values, size_t n_values, double* result) const
+    {
+        std::vector<size_t> segments(n_values);
+        std::vector<double> dx(n_values);
+        Locate(values, n_values, segments.data(), dx.data());
+        Eval(segments.data(), dx.data(), n_values, result);
+    }
+
+    // Finds the segment and the offset from the segment start for each value. For sorted values
+    // the search is linear in the total number of values and nodes.
+    void Locate(const double* values, size_t n_values, size_t* segments, double* dx) const
+    {
+        const size_t n_segments = x.size() - 1;
+        size_t segment = 0;
+        double previous = x.front();
+        for(size_t n = 0; n < n_values; ++n) {
+            const double value = values[n];
+            if(!(value >= x.front() && value <= x.back())) {
+                segments[n] = NoSegment();
+                dx[n] = 0;
+                continue;
+            }
+            if(value < previous) {
+                const auto iter = std::upper_bound(x.begin(), x.end(), value);
+                segment = static_cast<size_t>(std::distance(x.begin(), iter)) - 1;
+            }
+            previous = value;
+            while(segment + 1 < n_segments && value >= x[segment + 1])
+                ++segment;
+            segment = std::min(segment, n_segments - 1);
+            segments[n] = segment;
+            dx[n] = value - x[segment];
+        }
+    }
+
+    void Eval(const size_t* segments, const double* dx, size_t n_values, double* result) const
+    {
+        for(size_t n = 0; n < n_values; ++n) {
+            const size_t s = segments[n];
+            if(s == NoSegment()) {
+                result[n] = NaN();
+                continue;
+            }
+            const double t = dx[n];
+            result[n] = c0[s] + t * (c1[s] + t * (c2[s] + t * c3[s]));
+        }
+    }
+
+private:
+    void ComputeNaturalSpline(const std::vector<double>& h, const std::vector<double>& slopes)
+    {
+        const size_t n_nodes = x.size(), n_segments = n_nodes - 1;
+        // Second derivatives at the nodes, zero at the both ends.
+        std::vector<double> m(n_nodes, 0.);
+        if(n_nodes > 2) {
+            const size_t n_inner = n_nodes - 2;
+            std::vector<double> diag(n_inner), rhs(n_inner);
+            for(size_t n = 0; n < n_inner; ++n) {
+                diag[n] = 2 * (h[n] + h[n + 1]);
+                rhs[n] = 6 * (slopes[n + 1] - slopes[n]);
+            }
+            // Thomas algorithm for the symmetric tridiagonal system with off-diagonal elements h[n + 1].
+            for(size_t n = 1; n < n_inner; ++n) {
+                const double w = h[n] / diag[n - 1];
+                diag[n] -= w * h[n];
+                rhs[n] -= w * rhs[n - 1];
+            }
+            m[n_inner] = rhs[n_inner - 1] / diag[n_inner - 1];
+            for(size_t n = n_inner - 1; n > 0; --n)
+                m[n] = (rhs[n - 1] - h[n] * m[n + 1]) / diag[n - 1];
+        }
+
+        c1.resize(n_segments);
+        c2.resize(n_segments);
+        c3.resize(n_segments);
+        for(size_t n = 0; n < n_segments; ++n) {
+            c1[n] = slopes[n] - h[n] * (2 * m[n] + m[n + 1]) / 6;
+            c2[n] = m[n] / 2;
+            c3[n] = (m[n + 1] - m[n]) / (6 * h[n]);
+        }
+    }
+
+    // Cubic Hermite segments defined by the values and the first derivatives at the nodes.
+    void ComputeHermite(const std::vector<double>& h, const std::vector<double>& slopes, const std::vector<double>& d)
+    {
+        const size_t n_segments = x.size() - 1;
+        c1.resize(n_segments);
+        c2.resize(n_segments);
+        c3.resize(n_segments);
+        for(size_t n = 0; n < n_segments; ++n) {
+            c1[n] = d[n];
+            c2[n] = (3 * slopes[n] - 2 * d[n] - d[n + 1]) / h[n];
+            c3[n] = (d[n] + d[n + 1] - 2 * slopes[n]) / (h[n] * h[n]);
+        }
+    }
+
+    static std::vector<double> AkimaDerivatives(const std::vector<double>& slopes)
+    {
+        const size_t n_segments = slopes.size(), n_nodes = n_segments + 1;
+        if(n_segments < 2)
+            return std::vector<double>(n_nodes, slopes.front());
+
+        // Slopes extended by two segments on the each side: m[k + 2] corresponds to the segment k.
+        std::vector<double> m(n_segments + 4);
+        std::copy(slopes.begin(), slopes.end(), m.begin() + 2);
+        m[1] = 2 * m[2] - m[3];
+        m[0] = 3 * m[2] - 2 * m[3];
+        m[n_segments + 2] = 2 * m[n_segments + 1] - m[n_segments];
+        m[n_segments + 3] = 3 * m[n_segments + 1] - 2 * m[n_segments];
+
+        std::vector<double> d(n_nodes);
+        for(size_t n = 0; n < n_nodes; ++n) {
+            const double w_left = std::abs(m[n + 3] - m[n + 2]), w_right = std::abs(m[n + 1] - m[n]);
+            const double w = w_left + w_right;
+            d[n] = w > 0 ? (w_left * m[n + 1] + w_right * m[n + 2]) / w : (m[n + 1] + m[n + 2]) / 2;
+        }
+        return d;
+    }
+
+    static std::vector<double> PchipDerivatives(const std::vector<double>& h, const std::vector<double>& slopes)
+    {
+        const size_t n_segments = slopes.size(), n_nodes = n_segments + 1;
+        if(n_segments < 2)
+            return std::vector<double>(n_nodes, slopes.front());
+
+        std::vector<double> d(n_nodes);
+        for(size_t n = 1; n < n_segments; ++n) {
+            const double m_left = slopes[n - 1], m_right = slopes[n];
+            if(m_left * m_right <= 0) {
+                d[n] = 0;
+                continue;
+            }
+            const double w1 = 2 * h[n] + h[n - 1], w2 = h[n] + 2 * h[n - 1];
+            d[n] = (w1 + w2) / (w1 / m_left + w2 / m_right);
+        }
+        d.front() = PchipEndDerivative(h[0], h[1], slopes[0], slopes[1]);
+        d.back() = PchipEndDerivative(h[n_segments - 1], h[n_segments - 2], slopes[n_segments - 1],
+                                      slopes[n_segments - 2]);
+        return d;
+    }
+
+    // Shape-preserving three-point estimate of the derivative at the end node.
+    static double PchipEndDerivative(double h0, double h1, double m0, double m1)
+    {
+        const double d = ((2 * h0 + h1) * m0 - h0 * m1) / (h0 + h1);
+        if(d * m0 <= 0)
+            return 0;
+        if(m0 * m1 <= 0 && std::abs(d) > std::abs(3 * m0))
+            return 3 * m0;
+        return d;
+    }
+
+private:
+    std::vector<double> x, c0, c1, c2, c3;
+};
+
+} // namespace hh_analysis
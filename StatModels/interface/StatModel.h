@@ -3,10 +3,13 @@ This file is part of https://github.com/cms-hh/HHStatAnalysis. */
 
 #pragma once
 
+#include <mutex>
 #include "CombineHarvester/CombineTools/interface/CombineHarvester.h"
+#include "CombineHarvester/CombineTools/interface/CardWriter.h"
 #include "HHStatAnalysis/Core/interface/RootExt.h"
 #include "StatModelDescriptor.h"
 #include "ShapeNameRule.h"
+#include "ShapeIndex.h"
 
 namespace hh_analysis {
 namespace stat_models {
@@ -17,12 +20,25 @@ struct Yield {
     Yield(double _value, double _error) : value(_value), error(_error) {}
 };
 
+// Settings of the shape post-processing that is applied after the shapes are extracted.
+struct ShapePostProcessing {
+    std::vector<std::string> scaled_processes;
+    double rate_scale_factor;
+    std::map<std::string, std::string> renamed_processes;
+    bool fix_negative_bins, merge_bin_errors;
+    double bbb_threshold, merge_threshold;
+
+    ShapePostProcessing() : rate_scale_factor(1), fix_negative_bins(true), merge_bin_errors(false), bbb_threshold(0),
+        merge_threshold(0) {}
+};
+
 class StatModel {
 public:
     using v_str = std::vector<std::string>;
     using v_double = std::vector<double>;
     using Hist = TH1;
     using Hist2D = TH2;
+    using ChannelBuilder = std::function<void(ch::CombineHarvester& cb, const std::string& channel)>;
 
     static const v_str wildcard;
 
@@ -31,11 +47,21 @@ public:
     virtual ~StatModel() {}
     virtual void CreateDatacards(const std::string& output_path) = 0;
 
+    // Stat models that are created for the same shapes file share the opened file and its index while any of them
+    // (or any other owner of the returned index) exists. Histograms are read from the sidecar of the shapes file
+    // if it exists and is up to date (see convert_hh_shapes).
+    static std::shared_ptr<ShapeIndex> OpenShapes(const std::string& file_name);
+
 protected:
 
-    static void FixNegativeBins(ch::CombineHarvester& harvester);
-    static void RenameProcess(ch::CombineHarvester& harvester, const std::string& old_name,
-                              const std::string& new_name);
+    // Should be held while printing from the code that can be called concurrently (e.g. from the channel builders).
+    static std::mutex& PrintMutex();
+    static void MergeHarvester(ch::CombineHarvester& target, ch::CombineHarvester& source);
+    // Rate scaling, renaming, negative bins fixing and merging of the bin errors of the backgrounds
+    // (as in CombineHarvester::MergeBinErrors) are done in a single pass over the processes. Each shape is cloned
+    // at most once.
+    static void PostProcessShapes(ch::CombineHarvester& harvester, const ShapePostProcessing& settings);
+    static void MergeBinErrors(const std::vector<Hist*>& shapes, double bbb_threshold, double merge_threshold);
 
     virtual const v_str& SignalProcesses() const = 0;
     virtual const v_str& BackgroundProcesses() const = 0;
@@ -44,15 +70,28 @@ protected:
     virtual ShapeNameRule BackgroundShapeNameRule() const = 0;
 
     virtual ch::Categories GetChannelCategories(const std::string& channel);
+    // Shapes of all signal points, backgrounds and their systematics are taken from the already opened input file
+    // in a single pass over the harvester objects.
     virtual void ExtractShapes(ch::CombineHarvester& cb) const;
+    static std::string ResolveShapeName(const ShapeNameRule& rule, const ch::Object& obj);
+    std::unique_ptr<Hist> CloneShape(const std::string& name) const;
 
     template<typename T>
-    const T* ReadObject(const std::string& name) const { return root_ext::ReadObject<T>(*input_file, name); }
+    const T* ReadObject(const std::string& name) const { return shape_index->Get<T>(name); }
     virtual const Hist* GetSignalHistogram(const std::string& process, double point, const std::string& channel,
                                            const std::string& category, const std::string& region = "") const;
     virtual const Hist* GetBackgroundHistogram(const std::string& process, const std::string& channel,
                                                const std::string& category, const std::string& region = "") const;
 
+    // Channels are independent until the datacards are written, so a separate harvester is built for each channel.
+    // Channel harvesters are then merged into the output harvester. If desc.parallel_channels is set, channels are
+    // built concurrently using desc.n_threads: the builder should modify only the harvester of its channel and print
+    // while holding PrintMutex.
+    void BuildHarvester(ch::CombineHarvester& harvester, const ChannelBuilder& build_channel) const;
+    // Datacards for the combined, per-channel and per-category tags are written concurrently using desc.n_threads.
+    // In the parallel mode each tag is written from its own deep copy of the harvester into its own output files.
+    void WriteCards(const ch::CardWriter& writer, ch::CombineHarvester& harvester) const;
+
     static Yield GetYield(const Hist& hist);
     Yield GetSignalYield(const std::string& process, double point, const std::string& channel,
                          const std::string& category, const std::string& region = "") const;
@@ -61,6 +100,7 @@ protected:
 
 protected:
     StatModelDescriptor desc;
+    std::shared_ptr<ShapeIndex> shape_index;
     std::shared_ptr<TFile> input_file;
 };
 
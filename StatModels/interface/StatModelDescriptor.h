@@ -31,6 +31,8 @@ struct StatModelDescriptor {
     LimitType limit_type;
     std::string th_model_file;
     bool blind, morph, combine_channels, per_channel_limits, per_category_limits;
+    size_t n_threads;
+    bool parallel_channels;
     RangeWithStep<double> grid_x, grid_y;
 
     std::string label_status, label_scenario, label_lumi, title_x, title_y;
@@ -54,8 +56,8 @@ struct StatModelDescriptor {
 
     StatModelDescriptor() :
         limit_type(LimitType::ModelIndependent), blind(true), morph(false), combine_channels(true),
-        per_channel_limits(false), per_category_limits(false), draw_mh_exclusion(false), draw_mH_isolines(false),
-        iso_label_draw_margin(0.8) {}
+        per_channel_limits(false), per_category_limits(false), n_threads(1), parallel_channels(false),
+        draw_mh_exclusion(false), draw_mH_isolines(false), iso_label_draw_margin(0.8) {}
 };
 
 using ModelDescriptorCollection = std::unordered_map<std::string, StatModelDescriptor>;
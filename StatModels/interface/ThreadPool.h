@@ -0,0 +1,164 @@
+/*! Definition of the thread pool with a parallel loop over independent tasks.
+This file is part of https://github.com/cms-hh/HHStatAnalysis. */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <memory>
+#include <limits>
+#include "HHStatAnalysis/Core/interface/exception.h"
+
+namespace hh_analysis {
+
+// Fixed-size pool of worker threads. With a single thread no workers are started and all tasks are executed
+// directly in the calling thread, so that the serial behaviour is exactly reproduced.
+class ThreadPool {
+public:
+    // n_threads = 0 means the number of hardware threads.
+    explicit ThreadPool(size_t _n_threads = 1)
+        : n_threads(_n_threads ? _n_threads : std::max<size_t>(std::thread::hardware_concurrency(), 1)), stop(false)
+    {
+        if(n_threads == 1) return;
+        for(size_t n = 0; n < n_threads; ++n)
+            workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        condition.notify_all();
+        for(auto& worker : workers)
+            worker.join();
+    }
+
+    size_t GetNumberOfThreads() const { return n_threads; }
+
+    template<typename Function>
+    auto Submit(Function&& func) -> std::future<decltype(func())>
+    {
+        using Result = decltype(func());
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Function>(func));
+        auto future = task->get_future();
+        if(workers.empty()) {
+            (*task)();
+            return future;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(stop)
+                throw analysis::exception("Task is submitted to a stopped thread pool.");
+            tasks.push_back([task]() { (*task)(); });
+        }
+        condition.notify_one();
+        return future;
+    }
+
+    // Calls func(task_id) for all task_id in [0, n_tasks). The calling thread takes part in the execution,
+    // so ParallelFor can be safely used from inside of the tasks that are running in the same pool.
+    // If some tasks throw, the exception of the task with the lowest id is rethrown after all tasks are finished.
+    template<typename Function>
+    void ParallelFor(size_t n_tasks, const Function& func)
+    {
+        if(!n_tasks) return;
+        if(workers.empty() || n_tasks == 1) {
+            for(size_t task_id = 0; task_id < n_tasks; ++task_id)
+                func(task_id);
+            return;
+        }
+
+        auto state = std::make_shared<LoopState>(n_tasks);
+        const std::function<void(size_t)> body = [&func](size_t task_id) { func(task_id); };
+        const std::function<void(size_t)>* body_ptr = &body;
+        const size_t n_helpers = std::min(n_threads, n_tasks) - 1;
+        for(size_t n = 0; n < n_helpers; ++n) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back([state, body_ptr]() { state->Execute(body_ptr); });
+            }
+            condition.notify_one();
+        }
+        state->Execute(body_ptr);
+        state->Wait();
+    }
+
+private:
+    // Shared between the calling thread and the helpers. Helpers can start after the loop is already finished:
+    // in that case they don't find any task and don't touch the loop body.
+    struct LoopState {
+        const size_t n_tasks;
+        std::atomic<size_t> next_task;
+        size_t n_done;
+        size_t error_task;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done;
+
+        explicit LoopState(size_t _n_tasks)
+            : n_tasks(_n_tasks), next_task(0), n_done(0), error_task(std::numeric_limits<size_t>::max()) {}
+
+        void Execute(const std::function<void(size_t)>* body)
+        {
+            for(size_t task_id = next_task++; task_id < n_tasks; task_id = next_task++) {
+                std::exception_ptr task_error;
+                try {
+                    (*body)(task_id);
+                } catch(...) {
+                    task_error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if(task_error && task_id < error_task) {
+                    error_task = task_id;
+                    error = task_error;
+                }
+                if(++n_done == n_tasks)
+                    done.notify_all();
+            }
+        }
+
+        void Wait()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]() { return n_done == n_tasks; });
+            if(error)
+                std::rethrow_exception(error);
+        }
+    };
+
+    void WorkerLoop()
+    {
+        while(true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this]() { return stop || !tasks.empty(); });
+                if(stop && tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+private:
+    const size_t n_threads;
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stop;
+};
+
+} // namespace hh_analysis
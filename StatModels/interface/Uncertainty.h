@@ -3,8 +3,16 @@ This file is part of https://github.com/cms-hh/HHStatAnalysis. */
 
 #pragma once
 
+#include <cassert>
+#include <cmath>
+#include <exception>
+#include <limits>
+#include <map>
+#include <tuple>
+#include <boost/algorithm/string/replace.hpp>
 #include "CombineHarvester/CombineTools/interface/CombineHarvester.h"
 #include "CombineHarvester/CombineTools/interface/Systematics.h"
+#include "CombineHarvester/CombineTools/interface/Utilities.h"
 #include "HHStatAnalysis/Core/interface/EnumNameMap.h"
 #include "HHStatAnalysis/Core/interface/Tools.h"
 
@@ -32,6 +40,165 @@ ENUM_NAMES(UncVariation) = {
     { UncVariation::Down, "Down" },
 };
 
+// Collects uncertainties and adds all of them to the harvester in Apply. Selections of processes, analyses, channels
+// and bins, as well as full names of the uncertainties, are interned when uncertainties are added. Apply makes
+// a single pass over the processes of the harvester, in which each process is matched against each distinct
+// selection. The systematics are then created as in ch::CombineHarvester::AddSyst, in the order in which
+// the uncertainties were added and, for each uncertainty, in the order of the processes in the harvester.
+// A batch should be applied before it is destroyed.
+class UncertaintyBatch {
+public:
+    struct Selection {
+        std::vector<std::string> processes, analyses, channels, bins;
+
+        bool operator<(const Selection& other) const
+        {
+            return std::tie(processes, analyses, channels, bins)
+                    < std::tie(other.processes, other.analyses, other.channels, other.bins);
+        }
+
+        // Empty lists of analyses, channels or bins don't restrict the selection.
+        ch::CombineHarvester Select(ch::CombineHarvester& cb) const
+        {
+            auto selected = cb.cp().process(processes);
+            if(analyses.size())
+                selected.analysis(analyses);
+            if(channels.size())
+                selected.channel(channels);
+            if(bins.size())
+                selected.bin(bins);
+            return selected;
+        }
+
+        bool Contains(const ch::Process& proc) const
+        {
+            return Contains(processes, proc.process(), false) && Contains(analyses, proc.analysis(), true)
+                    && Contains(channels, proc.channel(), true) && Contains(bins, proc.bin(), true);
+        }
+
+    private:
+        static bool Contains(const std::vector<std::string>& list, const std::string& value, bool empty_matches)
+        {
+            if(list.empty()) return empty_matches;
+            return std::find(list.begin(), list.end(), value) != list.end();
+        }
+    };
+
+    UncertaintyBatch() {}
+    UncertaintyBatch(const UncertaintyBatch&) = delete;
+    UncertaintyBatch& operator=(const UncertaintyBatch&) = delete;
+
+    ~UncertaintyBatch()
+    {
+        assert(entries.empty() || std::uncaught_exception());
+    }
+
+    size_t size() const { return entries.size(); }
+
+    // Symmetric values are passed with std::isnan(value_down).
+    void Add(const Selection& selection, const std::string& full_name, UncDistributionType distr_type,
+             double value_up, double value_down = std::numeric_limits<double>::quiet_NaN())
+    {
+        Entry entry;
+        entry.selection_id = Intern(selection, selections, selection_ids);
+        entry.name_id = Intern(full_name, names, name_ids);
+        entry.distr_type = distr_type;
+        entry.asymm = !std::isnan(value_down);
+        entry.value_up = value_up;
+        entry.value_down = entry.asymm ? value_down : 0.;
+        entries.push_back(entry);
+    }
+
+    void Apply(ch::CombineHarvester& cb)
+    {
+        std::vector<std::vector<const ch::Process*>> selected(selections.size());
+        cb.ForEachProc([&](ch::Process* proc) {
+            for(size_t n = 0; n < selections.size(); ++n) {
+                if(selections[n].Contains(*proc))
+                    selected[n].push_back(proc);
+            }
+        });
+
+        for(const Entry& entry : entries) {
+            for(const ch::Process* proc : selected.at(entry.selection_id))
+                AddSystematic(cb, entry, *proc);
+        }
+        entries.clear();
+        selections.clear();
+        selection_ids.clear();
+        names.clear();
+        name_ids.clear();
+    }
+
+private:
+    struct Entry {
+        size_t selection_id, name_id;
+        UncDistributionType distr_type;
+        bool asymm;
+        double value_up, value_down;
+    };
+
+    template<typename Value>
+    static size_t Intern(const Value& value, std::vector<Value>& values, std::map<Value, size_t>& ids)
+    {
+        const auto iter = ids.find(value);
+        if(iter != ids.end())
+            return iter->second;
+        const size_t id = values.size();
+        values.push_back(value);
+        ids[value] = id;
+        return id;
+    }
+
+    void AddSystematic(ch::CombineHarvester& cb, const Entry& entry, const ch::Process& proc) const
+    {
+        std::string name = names.at(entry.name_id);
+        if(name.find('$') != std::string::npos) {
+            boost::replace_all(name, "$BIN", proc.bin());
+            boost::replace_all(name, "$PROCESS", proc.process());
+            boost::replace_all(name, "$MASS", proc.mass());
+            boost::replace_all(name, "$ERA", proc.era());
+            boost::replace_all(name, "$CHANNEL", proc.channel());
+            boost::replace_all(name, "$ANALYSIS", proc.analysis());
+        }
+
+        ch::Systematic syst;
+        ch::SetProperties(&syst, &proc);
+        syst.set_name(name);
+        syst.set_type(analysis::EnumNameMap<UncDistributionType>::GetDefault().EnumToString(entry.distr_type));
+        if(entry.distr_type == UncDistributionType::shape) {
+            syst.set_asymm(true);
+            syst.set_value_u(1.0);
+            syst.set_value_d(1.0);
+            syst.set_scale(entry.value_up);
+        } else {
+            syst.set_asymm(entry.asymm);
+            syst.set_value_u(entry.value_up);
+            syst.set_value_d(entry.value_down);
+        }
+
+        ch::Parameter* param = cb.GetParameter(name);
+        if(!param) {
+            ch::Parameter new_param;
+            new_param.set_name(name);
+            cb.InsertParameter(new_param);
+            param = cb.GetParameter(name);
+        }
+        if(entry.distr_type == UncDistributionType::lnU) {
+            param->set_err_d(0.);
+            param->set_err_u(0.);
+        }
+        cb.InsertSystematic(syst);
+    }
+
+private:
+    std::vector<Entry> entries;
+    std::vector<Selection> selections;
+    std::map<Selection, size_t> selection_ids;
+    std::vector<std::string> names;
+    std::map<std::string, size_t> name_ids;
+};
+
 struct Uncertainty {
     std::string name;
     CorrelationRange correlation_range = CorrelationRange::Experiment;
@@ -114,36 +281,30 @@ struct Uncertainty {
         static const std::string channel = "$CHANNEL";
         static const std::string category = "$BIN";
         static const std::string sep = "_";
-        std::ostringstream ss;
+        std::string full_name;
         if(correlation_range <= CorrelationRange::Experiment)
-            ss << exp_name << sep;
+            full_name += exp_name + sep;
 //        if(distr_type == UncDistributionType::shape)
-//            ss << distr_type << sep;
+//            full_name += DistrTypeName() + sep;
         if(name.size())
-            ss << name << sep;
+            full_name += name + sep;
         if(correlation_range <= CorrelationRange::Analysis)
-            ss << analysis << sep;
+            full_name += analysis + sep;
         if(correlation_range == CorrelationRange::Channel)
-            ss << channel << sep;
+            full_name += channel + sep;
         if(correlation_range <= CorrelationRange::Category)
-            ss << category << sep;
+            full_name += category + sep;
         if(use_era)
-            ss << era;
-        else if(ss.cur > 0)
-            ss.seekp(-1, ss.cur);
-
-        std::string full_name = ss.str();
-        if(!use_era)
-            full_name.erase(full_name.size() - 1);
+            full_name += era;
+        else if(full_name.size())
+            full_name.pop_back();
         return full_name;
     }
 
     std::string FullNameBinByBin(const std::string& process, size_t bin) const
     {
         static const std::string sep = "_";
-        std::ostringstream ss;
-        ss << FullName() << sep << process << sep << "bin" << sep << bin;
-        return ss.str();
+        return FullName() + sep + process + sep + "bin" + sep + std::to_string(bin);
     }
 
     bool operator<(const Uncertainty& other) const
@@ -153,6 +314,11 @@ struct Uncertainty {
         return FullName() < other.FullName();
     }
 
+    const std::string& DistrTypeName() const
+    {
+        return analysis::EnumNameMap<UncDistributionType>::GetDefault().EnumToString(distr_type);
+    }
+
     double ConvertToDatacardUncValue(double value) const
     {
         return distr_type == UncDistributionType::lnN ? 1 + value : value;
@@ -160,26 +326,15 @@ struct Uncertainty {
 
     template<typename SystMap>
     void ApplyMap(ch::CombineHarvester& cb, const SystMap& syst_map,
-               const std::vector<std::string>& all_processes) const
+                  const std::vector<std::string>& all_processes) const
     {
-        auto cb_copy = cb.cp().process(all_processes);
-        if(analysis_names.size())
-            cb_copy = cb_copy.analysis(analysis_names);
-        if(channel_names.size())
-            cb_copy = cb_copy.channel(channel_names);
-        if(category_names.size())
-            cb_copy = cb_copy.bin(category_names);
-        std::ostringstream ss_distr;
-        ss_distr << distr_type;
-        cb_copy.AddSyst(cb, FullName(), ss_distr.str(), syst_map);
+        GetSelection(all_processes).Select(cb).AddSyst(cb, FullName(), DistrTypeName(), syst_map);
     }
 
     template<typename SystMap, typename ...Processes>
     void ApplyMap(ch::CombineHarvester& cb, const SystMap& syst_map, const Processes& ...processes) const
     {
-        std::vector<std::string> all_processes;
-        analysis::tools::put_back(all_processes, processes...);
-        ApplyMap(cb, syst_map, all_processes);
+        ApplyMap(cb, syst_map, JoinProcesses(processes...));
     }
 
     template<typename ...Processes>
@@ -189,7 +344,14 @@ struct Uncertainty {
     }
 
     template<typename ...Processes>
-    void Apply(ch::CombineHarvester& cb, std::pair<double, double> up_down_values, const Processes& ...processes) const
+    void Apply(UncertaintyBatch& batch, double value, const Processes& ...processes) const
+    {
+        batch.Add(GetSelection(JoinProcesses(processes...)), FullName(), distr_type, ConvertToDatacardUncValue(value));
+    }
+
+    template<typename ...Processes>
+    void Apply(ch::CombineHarvester& cb, std::pair<double, double> up_down_values,
+               const Processes& ...processes) const
     {
         const auto up_down = std::make_pair(ConvertToDatacardUncValue(up_down_values.first),
                                             ConvertToDatacardUncValue(up_down_values.second));
@@ -197,24 +359,46 @@ struct Uncertainty {
     }
 
     template<typename ...Processes>
-    void Apply(ch::CombineHarvester& cb, const Processes& ...processes) const
+    void Apply(UncertaintyBatch& batch, std::pair<double, double> up_down_values,
+               const Processes& ...processes) const
+    {
+        batch.Add(GetSelection(JoinProcesses(processes...)), FullName(), distr_type,
+                  ConvertToDatacardUncValue(up_down_values.first), ConvertToDatacardUncValue(up_down_values.second));
+    }
+
+    template<typename Harvester, typename ...Processes>
+    void Apply(Harvester& cb, const Processes& ...processes) const
     {
         Apply(cb, 1.0, processes...);
     }
 
-    void ApplyBinByBin(ch::CombineHarvester& cb, const std::string& process, size_t bin_id)
+    void ApplyBinByBin(ch::CombineHarvester& cb, const std::string& process, size_t bin_id) const
+    {
+        GetSelection({ process }).Select(cb).AddSyst(cb, FullNameBinByBin(process, bin_id), DistrTypeName(),
+                                                     ch::syst::SystMap<>::init(1.0));
+    }
+
+    void ApplyBinByBin(UncertaintyBatch& batch, const std::string& process, size_t bin_id) const
+    {
+        batch.Add(GetSelection({ process }), FullNameBinByBin(process, bin_id), distr_type, 1.0);
+    }
+
+    UncertaintyBatch::Selection GetSelection(const std::vector<std::string>& processes) const
     {
-        const auto syst_map = ch::syst::SystMap<>::init(1.0);
-        auto cb_copy = cb.cp().process({process});
-        if(analysis_names.size())
-            cb_copy = cb_copy.analysis(analysis_names);
-        if(channel_names.size())
-            cb_copy = cb_copy.channel(channel_names);
-        if(category_names.size())
-            cb_copy = cb_copy.bin(category_names);
-        std::ostringstream ss_distr;
-        ss_distr << distr_type;
-        cb_copy.AddSyst(cb, FullNameBinByBin(process, bin_id), ss_distr.str(), syst_map);
+        UncertaintyBatch::Selection selection;
+        selection.processes = processes;
+        selection.analyses = analysis_names;
+        selection.channels = channel_names;
+        selection.bins = category_names;
+        return selection;
+    }
+
+    template<typename ...Processes>
+    static std::vector<std::string> JoinProcesses(const Processes& ...processes)
+    {
+        std::vector<std::string> all_processes;
+        analysis::tools::put_back(all_processes, processes...);
+        return all_processes;
     }
 };
 
@@ -226,8 +410,8 @@ struct GlobalUncertainty : Uncertainty {
                       double _up_value = NaN, double _down_value = NaN)
         : Uncertainty(_name, _correlation_range, _distr_type), up_value(_up_value), down_value(_down_value) {}
 
-    template<typename ...Processes>
-    void ApplyGlobal(ch::CombineHarvester& cb, const Processes& ...processes) const
+    template<typename Harvester, typename ...Processes>
+    void ApplyGlobal(Harvester& cb, const Processes& ...processes) const
     {
         if(distr_type == UncDistributionType::shape)
             Apply(cb, processes...);
@@ -0,0 +1,91 @@
+#!/usr/bin/env python
+# Compare two sets of datacards created by create_hh_datacards (e.g. serial vs parallel output).
+# Text files should be identical byte by byte. ROOT files are compared object by object, because they contain
+# creation times: histograms should have identical binning, bin contents and bin errors, other objects are
+# compared only by the class name.
+# This file is part of https://github.com/cms-hh/HHStatAnalysis.
+
+import sys
+import os
+import argparse
+import filecmp
+import ROOT
+
+parser = argparse.ArgumentParser(description='Compare two sets of datacards.',
+                  formatter_class = lambda prog: argparse.HelpFormatter(prog, max_help_position=30, width=90))
+parser.add_argument('reference', type=str, help="path with the reference datacards")
+parser.add_argument('target', type=str, help="path with the datacards to compare")
+args = parser.parse_args()
+
+def list_files(path):
+    files = set()
+    for root, dirs, file_names in os.walk(path):
+        for file_name in file_names:
+            files.add(os.path.relpath(os.path.join(root, file_name), path))
+    return files
+
+def list_objects(directory, prefix, objects):
+    for key in directory.GetListOfKeys():
+        name = prefix + key.GetName()
+        obj = key.ReadObj()
+        if obj.InheritsFrom('TDirectory'):
+            list_objects(obj, name + '/', objects)
+        else:
+            objects[name] = obj
+    return objects
+
+def compare_hists(ref, target):
+    if ref.GetNcells() != target.GetNcells():
+        return 'different number of bins'
+    ref_axis, target_axis = ref.GetXaxis(), target.GetXaxis()
+    for n in range(1, ref_axis.GetNbins() + 2):
+        if ref_axis.GetBinLowEdge(n) != target_axis.GetBinLowEdge(n):
+            return 'different binning'
+    for n in range(ref.GetNcells()):
+        if ref.GetBinContent(n) != target.GetBinContent(n):
+            return 'different content of bin {}'.format(n)
+        if ref.GetBinError(n) != target.GetBinError(n):
+            return 'different error of bin {}'.format(n)
+    return None
+
+def compare_root_files(ref_name, target_name):
+    ref_file = ROOT.TFile.Open(ref_name)
+    target_file = ROOT.TFile.Open(target_name)
+    ref_objects = list_objects(ref_file, '', {})
+    target_objects = list_objects(target_file, '', {})
+    errors = []
+    for name in sorted(set(ref_objects.keys()) ^ set(target_objects.keys())):
+        errors.append("object '{}' is present only in one of the files".format(name))
+    for name in sorted(set(ref_objects.keys()) & set(target_objects.keys())):
+        ref, target = ref_objects[name], target_objects[name]
+        if ref.ClassName() != target.ClassName():
+            errors.append("object '{}' has different types".format(name))
+        elif ref.InheritsFrom('TH1'):
+            error = compare_hists(ref, target)
+            if error is not None:
+                errors.append("histogram '{}': {}".format(name, error))
+    ref_file.Close()
+    target_file.Close()
+    return errors
+
+ref_files = list_files(args.reference)
+target_files = list_files(args.target)
+n_errors = 0
+for file_name in sorted(ref_files ^ target_files):
+    print "{}: is present only in one of the paths".format(file_name)
+    n_errors += 1
+
+for file_name in sorted(ref_files & target_files):
+    ref_name = os.path.join(args.reference, file_name)
+    target_name = os.path.join(args.target, file_name)
+    if file_name.endswith('.root'):
+        errors = compare_root_files(ref_name, target_name)
+    else:
+        errors = [] if filecmp.cmp(ref_name, target_name, shallow=False) else [ 'files are different' ]
+    for error in errors:
+        print "{}: {}".format(file_name, error)
+    n_errors += len(errors)
+
+print "{} files are compared, {} differences are found.".format(len(ref_files | target_files), n_errors)
+if n_errors:
+    sys.exit(1)
@@ -0,0 +1,45 @@
+#!/usr/bin/env python
+# Client for the create_hh_datacards server (create_hh_datacards --server SOCKET).
+# This file is part of https://github.com/cms-hh/HHStatAnalysis.
+
+import sys
+import socket
+import argparse
+
+parser = argparse.ArgumentParser(description='Send a request to the create_hh_datacards server.',
+                  formatter_class = lambda prog: argparse.HelpFormatter(prog, max_help_position=30, width=90))
+parser.add_argument('--socket', required=True, type=str, metavar='PATH', help="unix socket of the server")
+parser.add_argument('--cfg', required=False, type=str, default='', help="configuration file with model descriptors")
+parser.add_argument('--model-desc', required=False, dest='model_desc', type=str, default='',
+                    help="comma separated list of model descriptors")
+parser.add_argument('--shapes', required=False, type=str, default='', help="file with input shapes")
+parser.add_argument('--output', required=False, type=str, default='', help="path where to store datacards")
+parser.add_argument('--shutdown', action="store_true", help="stop the server")
+args = parser.parse_args()
+
+if args.shutdown:
+    request = 'shutdown'
+else:
+    for name in [ 'cfg', 'model_desc', 'shapes', 'output' ]:
+        value = getattr(args, name)
+        if len(value) == 0:
+            raise RuntimeError("Argument '{}' is not specified.".format(name.replace('_', '-')))
+        if '\t' in value or '\n' in value:
+            raise RuntimeError("Argument '{}' contains tab or new line.".format(name.replace('_', '-')))
+    request = '\t'.join([ 'create', args.cfg, args.model_desc, args.shapes, args.output ])
+
+client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+client.connect(args.socket)
+client.sendall(request + '\n')
+response = ''
+while not response.endswith('\n'):
+    data = client.recv(4096)
+    if not data:
+        break
+    response += data
+client.close()
+
+status, _, message = response.strip().partition('\t')
+print(message)
+if status != 'OK':
+    sys.exit(1)
@@ -1,5 +1,5 @@
 #!/usr/bin/env python
-# Merge hh limits.
+# Merge hh limits. For large sets of limit files use the parallel merge_hh_limits executable.
 # This file is part of https://github.com/cms-hh/HHStatAnalysis.
 
 import sys
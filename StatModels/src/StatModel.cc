@@ -2,6 +2,8 @@
 This file is part of https://github.com/cms-hh/HHStatAnalysis. */
 
 #include "HHStatAnalysis/StatModels/interface/StatModel.h"
+#include "HHStatAnalysis/StatModels/interface/ThreadPool.h"
+#include "HHStatAnalysis/StatModels/interface/RootThreads.h"
 
 namespace hh_analysis {
 namespace stat_models {
@@ -9,27 +11,140 @@ namespace stat_models {
 const StatModel::v_str StatModel::wildcard = { "*" };
 
 StatModel::StatModel(const StatModelDescriptor& _desc, const std::string& input_file_name) :
-    desc(_desc), input_file(root_ext::OpenRootFile(input_file_name))
+    desc(_desc), shape_index(OpenShapes(input_file_name)), input_file(shape_index->GetFile())
 {
 }
 
-void StatModel::FixNegativeBins(ch::CombineHarvester& harvester)
+std::shared_ptr<ShapeIndex> StatModel::OpenShapes(const std::string& file_name)
 {
-    harvester.ForEachProc([](ch::Process *p) {
-        if(!ch::HasNegativeBins(p->shape())) return;
-        std::cout << "[Negative bins] Fixing negative bins for " << p->bin() << "," << p->process() << "\n";
-        auto new_shape = p->ClonedShape();
-        ch::ZeroNegativeBins(new_shape.get());
-        p->set_shape(std::move(new_shape), false);
-    });
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<ShapeIndex>> opened_shapes;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& cached_index = opened_shapes[file_name];
+    auto index = cached_index.lock();
+    if(!index) {
+        index = std::make_shared<ShapeIndex>(root_ext::OpenRootFile(file_name), ShapeSidecar::TryOpen(file_name));
+        cached_index = index;
+    }
+    return index;
 }
 
-void StatModel::RenameProcess(ch::CombineHarvester& harvester, const std::string& old_name, const std::string& new_name)
+void StatModel::PostProcessShapes(ch::CombineHarvester& harvester, const ShapePostProcessing& settings)
 {
-    harvester.ForEachObj([&](ch::Object *obj) {
-        if(obj->process() == old_name)
-            obj->set_process(new_name);
+    const std::set<std::string> scaled_processes(settings.scaled_processes.begin(), settings.scaled_processes.end());
+    std::vector<ch::Process*> processes;
+    std::vector<std::unique_ptr<Hist>> shapes;
+    std::map<std::string, std::vector<Hist*>> bkg_shapes;
+
+    harvester.ForEachProc([&](ch::Process *p) {
+        if(scaled_processes.count(p->process()))
+            p->set_rate(p->rate() * settings.rate_scale_factor);
+        const auto new_name = settings.renamed_processes.find(p->process());
+        if(new_name != settings.renamed_processes.end())
+            p->set_process(new_name->second);
+        if(!p->shape()) return;
+
+        const bool fix_negative_bins = settings.fix_negative_bins && ch::HasNegativeBins(p->shape());
+        const bool merge_bin_errors = settings.merge_bin_errors && !p->signal();
+        if(!fix_negative_bins && !merge_bin_errors) return;
+
+        auto shape = p->ClonedScaledShape();
+        if(fix_negative_bins) {
+            {
+                std::lock_guard<std::mutex> lock(PrintMutex());
+                std::cout << "[Negative bins] Fixing negative bins for " << p->bin() << "," << p->process() << "\n";
+            }
+            ch::ZeroNegativeBins(shape.get());
+            const double integral = shape->Integral();
+            if(integral > 0)
+                shape->Scale(p->rate() / integral);
+        }
+        if(merge_bin_errors)
+            bkg_shapes[p->bin()].push_back(shape.get());
+        processes.push_back(p);
+        shapes.push_back(std::move(shape));
     });
+
+    for(const auto& bin_shapes : bkg_shapes)
+        MergeBinErrors(bin_shapes.second, settings.bbb_threshold, settings.merge_threshold);
+    for(size_t n = 0; n < processes.size(); ++n)
+        processes.at(n)->set_shape(std::move(shapes.at(n)), false);
+
+    if(settings.renamed_processes.empty()) return;
+    const auto rename = [&](ch::Object *obj) {
+        const auto new_name = settings.renamed_processes.find(obj->process());
+        if(new_name != settings.renamed_processes.end())
+            obj->set_process(new_name->second);
+    };
+    harvester.ForEachObs(rename);
+    harvester.ForEachSyst(rename);
+}
+
+void StatModel::MergeBinErrors(const std::vector<Hist*>& shapes, double bbb_threshold, double merge_threshold)
+{
+    if(shapes.empty()) return;
+    for(int bin = 1; bin <= shapes.front()->GetNbinsX(); ++bin) {
+        double total_bbb = 0;
+        std::vector<std::pair<double, Hist*>> bbb_shapes;
+        for(Hist* shape : shapes) {
+            const double value = shape->GetBinContent(bin), error = shape->GetBinError(bin);
+            if(value == 0 && error == 0) continue;
+            if(value == 0 || error / value > bbb_threshold) {
+                total_bbb += error * error;
+                bbb_shapes.emplace_back(error * error, shape);
+            }
+        }
+        if(total_bbb == 0) continue;
+        std::stable_sort(bbb_shapes.begin(), bbb_shapes.end(),
+                         [](const std::pair<double, Hist*>& a, const std::pair<double, Hist*>& b) {
+            return a.first < b.first;
+        });
+        double removed = 0;
+        for(size_t n = 0; n + 1 < bbb_shapes.size(); ++n) {
+            if(bbb_shapes.at(n).first + removed >= merge_threshold * total_bbb) continue;
+            removed += bbb_shapes.at(n).first;
+            bbb_shapes.at(n).second->SetBinError(bin, 0);
+        }
+        const double expand = std::sqrt(1. / (1. - removed / total_bbb));
+        for(const auto& entry : bbb_shapes)
+            entry.second->SetBinError(bin, entry.second->GetBinError(bin) * expand);
+    }
+}
+
+void StatModel::MergeHarvester(ch::CombineHarvester& target, ch::CombineHarvester& source)
+{
+    source.ForEachObs([&](ch::Observation* obs) { target.InsertObservation(*obs); });
+    source.ForEachProc([&](ch::Process* proc) { target.InsertProcess(*proc); });
+    source.ForEachSyst([&](ch::Systematic* syst) { target.InsertSystematic(*syst); });
+    for(const auto& param : source.GetParameters()) {
+        if(!target.GetParameter(param.name()))
+            target.InsertParameter(param);
+    }
+}
+
+std::mutex& StatModel::PrintMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+void StatModel::BuildHarvester(ch::CombineHarvester& harvester, const ChannelBuilder& build_channel) const
+{
+    std::vector<ch::CombineHarvester> channel_harvesters(desc.channels.size());
+    ThreadPool pool(desc.parallel_channels ? desc.n_threads : 1);
+    if(pool.GetNumberOfThreads() == 1 || desc.channels.size() < 2) {
+        for(size_t n = 0; n < desc.channels.size(); ++n)
+            build_channel(channel_harvesters.at(n), desc.channels.at(n));
+    } else {
+        EnableRootThreadSafety();
+        HistDirectoryScope hist_directory_scope;
+        pool.ParallelFor(desc.channels.size(), [&](size_t n) {
+            build_channel(channel_harvesters.at(n), desc.channels.at(n));
+        });
+    }
+    for(auto& channel_harvester : channel_harvesters)
+        MergeHarvester(harvester, channel_harvester);
 }
 
 ch::Categories StatModel::GetChannelCategories(const std::string& channel)
@@ -45,16 +160,68 @@ ch::Categories StatModel::GetChannelCategories(const std::string& channel)
 void StatModel::ExtractShapes(ch::CombineHarvester& cb) const
 {
     const auto signal_rule = SignalShapeNameRule().SetPrefix(desc.signal_point_prefix);
+    std::map<std::string, ShapeNameRule> point_rules;
     for(const std::string& point_str : desc.signal_points) {
         const double point = Parse<double>(point_str);
-        const auto point_rule = signal_rule.SetPoint(point);
-        cb.cp().process(SignalProcesses()).mass({point_str})
-               .ExtractShapes(input_file->GetName(), point_rule, point_rule.AddSystematicVariable());
+        point_rules[point_str] = signal_rule.SetPoint(point);
     }
-
     const auto bkg_rule = BackgroundShapeNameRule();
-    cb.cp().process(BackgroundProcesses())
-           .ExtractShapes(input_file->GetName(), bkg_rule, bkg_rule.AddSystematicVariable());
+
+    const auto find_rule = [&](const ch::Object& obj) -> const ShapeNameRule* {
+        const auto& signals = SignalProcesses();
+        if(std::find(signals.begin(), signals.end(), obj.process()) != signals.end()) {
+            const auto iter = point_rules.find(obj.mass());
+            return iter != point_rules.end() ? &iter->second : nullptr;
+        }
+        const auto& backgrounds = BackgroundProcesses();
+        if(std::find(backgrounds.begin(), backgrounds.end(), obj.process()) != backgrounds.end())
+            return &bkg_rule;
+        return nullptr;
+    };
+
+    // As in ch::CombineHarvester::ExtractShapes, objects that already have shapes are not modified.
+    cb.ForEachObs([&](ch::Observation* obs) {
+        if(obs->shape() || obs->data()) return;
+        obs->set_shape(CloneShape(ResolveShapeName(bkg_rule, *obs)), true);
+    });
+
+    cb.ForEachProc([&](ch::Process* proc) {
+        if(proc->shape() || proc->pdf() || proc->data()) return;
+        const ShapeNameRule* rule = find_rule(*proc);
+        if(!rule) return;
+        proc->set_shape(CloneShape(ResolveShapeName(*rule, *proc)), true);
+    });
+
+    cb.ForEachSyst([&](ch::Systematic* syst) {
+        if(syst->type() != "shape" && syst->type() != "shapeN2" && syst->type() != "shapeU"
+                && syst->type() != "shape?") return;
+        if(syst->shape_u() || syst->shape_d() || syst->data_u() || syst->data_d()) return;
+        const ShapeNameRule* rule = find_rule(*syst);
+        if(!rule) return;
+        const std::string nominal_name = ResolveShapeName(*rule, *syst);
+        const auto syst_rule = ShapeNameRule(ResolveShapeName(rule->AddSystematicVariable(), *syst));
+        const std::string up_name = syst_rule.SetSystematic(syst->name(), UncVariation::Up);
+        const std::string down_name = syst_rule.SetSystematic(syst->name(), UncVariation::Down);
+        if(syst->type() == "shape?") {
+            if(!shape_index->Contains(up_name) || !shape_index->Contains(down_name)) {
+                syst->set_type("lnN");
+                return;
+            }
+            syst->set_type("shape");
+        }
+        syst->set_shapes(CloneShape(up_name), CloneShape(down_name), ReadObject<Hist>(nominal_name));
+    });
+}
+
+std::string StatModel::ResolveShapeName(const ShapeNameRule& rule, const ch::Object& obj)
+{
+    return rule.SetBin(obj.bin()).SetProcess(obj.process()).SetVariable(ShapeNameRule::Mass, obj.mass())
+               .SetChannel(obj.channel()).SetAnalysis(obj.analysis()).SetEra(obj.era());
+}
+
+std::unique_ptr<StatModel::Hist> StatModel::CloneShape(const std::string& name) const
+{
+    return std::unique_ptr<Hist>(root_ext::CloneObject(*ReadObject<Hist>(name), "", true));
 }
 
 const StatModel::Hist* StatModel::GetSignalHistogram(const std::string& process, double point,
@@ -79,6 +246,39 @@ const StatModel::Hist* StatModel::GetBackgroundHistogram(const std::string& proc
     return ReadObject<Hist>(name_rule);
 }
 
+void StatModel::WriteCards(const ch::CardWriter& writer, ch::CombineHarvester& harvester) const
+{
+    std::vector<std::pair<std::string, ch::CombineHarvester>> tags;
+    if(desc.combine_channels)
+        tags.emplace_back("cmb", harvester.cp());
+    if(desc.per_channel_limits) {
+        for(const auto& chn : desc.channels)
+            tags.emplace_back(chn, harvester.cp().channel({chn}));
+    }
+    if(desc.per_category_limits) {
+        for(size_t n = 0; n < desc.categories.size(); ++n)
+            tags.emplace_back(desc.categories.at(n), harvester.cp().bin_id({int(n)}));
+    }
+
+    // The morphing workspace is shared between all tags and RooFit objects can't be written concurrently.
+    ThreadPool pool(desc.morph ? 1 : desc.n_threads);
+    if(pool.GetNumberOfThreads() == 1 || tags.size() < 2) {
+        for(auto& tag : tags)
+            writer.WriteCards(tag.first, tag.second);
+        return;
+    }
+
+    // Filtered copies share the objects and the shapes with the original harvester, so each tag gets its own deep
+    // copy before the cards are written concurrently.
+    EnableRootThreadSafety();
+    HistDirectoryScope hist_directory_scope;
+    for(auto& tag : tags)
+        tag.second = tag.second.deep();
+    pool.ParallelFor(tags.size(), [&](size_t n) {
+        writer.WriteCards(tags.at(n).first, tags.at(n).second);
+    });
+}
+
 Yield StatModel::GetYield(const Hist& hist)
 {
     Yield yield;
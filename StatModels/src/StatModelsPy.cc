@@ -69,6 +69,8 @@ BOOST_PYTHON_MODULE(libHHStatAnalysisStatModels)
         .def_readwrite("combine_channels", &StatModelDescriptor::combine_channels)
         .def_readwrite("per_channel_limits", &StatModelDescriptor::per_channel_limits)
         .def_readwrite("per_category_limits", &StatModelDescriptor::per_category_limits)
+        .def_readwrite("n_threads", &StatModelDescriptor::n_threads)
+        .def_readwrite("parallel_channels", &StatModelDescriptor::parallel_channels)
         .def_readwrite("grid_x", &StatModelDescriptor::grid_x)
         .def_readwrite("grid_y", &StatModelDescriptor::grid_y)
         .def_readwrite("label_status", &StatModelDescriptor::label_status)